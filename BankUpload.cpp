@@ -0,0 +1,247 @@
+/*
+   Copyright (c) 2020 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#include "BankUpload.h"
+
+#include "Synth.h"
+#include "SynthBank.h"
+#include "BankDumpCapability.h"
+#include "ProgramDumpCapability.h"
+
+#include "fmt/format.h"
+
+namespace midikraft {
+
+	// Passes the updates of the upload thread on to the message thread, where the UI behind the progress handler lives
+	class MessageThreadProgress : public ProgressHandler {
+	public:
+		MessageThreadProgress(std::shared_ptr<ProgressHandler> target) : target_(target) {}
+
+		virtual bool shouldAbort() const override { return target_->shouldAbort(); }
+		virtual void setProgressPercentage(double zeroToOne) override {
+			auto target = target_;
+			MessageManager::callAsync([target, zeroToOne]() { target->setProgressPercentage(zeroToOne); });
+		}
+		virtual void onSuccess() override {
+			auto target = target_;
+			MessageManager::callAsync([target]() { target->onSuccess(); });
+		}
+		virtual void onCancel() override {
+			auto target = target_;
+			MessageManager::callAsync([target]() { target->onCancel(); });
+		}
+		virtual void setMessage(std::string const &message) override {
+			auto target = target_;
+			MessageManager::callAsync([target, message]() { target->setMessage(message); });
+		}
+
+	private:
+		std::shared_ptr<ProgressHandler> target_;
+	};
+
+	BankUpload::BankUpload(std::shared_ptr<Synth> synth, MidiBankNumber bankNo, std::shared_ptr<ProgressHandler> progressHandler) :
+		synth_(synth), bankNo_(bankNo), pacing_(synth, RequestPacing::Mode::UPLOAD),
+		total_(0), sent_(0), finished_(false)
+	{
+		if (progressHandler) {
+			messageThreadProgress_ = std::make_unique<MessageThreadProgress>(progressHandler);
+			progressHandler_ = std::make_unique<ThrottledProgress>(messageThreadProgress_.get(), ThrottledProgress::updatesPerSecondSetting());
+		}
+	}
+
+	std::string BankUpload::uploadKey(std::shared_ptr<Synth> synth, MidiBankNumber bankNo)
+	{
+		return fmt::format("{}-{}", synth->getName(), bankNo.toZeroBased());
+	}
+
+	bool BankUpload::addPatches(std::map<int, PatchHolder> const &patchesByPosition, TPatchSentHandler onPatchSent, TFinishedHandler onFinished)
+	{
+		ScopedLock lock(lock_);
+		if (finished_) {
+			return false;
+		}
+		if (onPatchSent) onPatchSent_.push_back(onPatchSent);
+		if (onFinished) onFinished_.push_back(onFinished);
+		for (auto const &patch : patchesByPosition) {
+			if (queue_.find(patch.first) == queue_.end()) {
+				total_++;
+			}
+			queue_[patch.first] = patch.second;
+		}
+		return true;
+	}
+
+	void BankUpload::sendTo(std::shared_ptr<MidiStandIn> standIn)
+	{
+		standIn_ = standIn;
+	}
+
+	void BankUpload::run()
+	{
+		auto location = midikraft::Capability::hasCapability<MidiLocationCapability>(synth_);
+		if (!standIn_ && (!location || !location->channel().isValid())) {
+			SimpleLogger::instance()->postMessage(fmt::format("Synth {} is currently not detected, please turn on and re-run connectivity check", synth_->getName()));
+			finish(false);
+			return;
+		}
+
+		auto bankSendCapability = midikraft::Capability::hasCapability<BankSendCapability>(synth_);
+		int bankSize = SynthBank::numberOfPatchesInBank(synth_, bankNo_);
+		while (true) {
+			std::map<int, PatchHolder> batch;
+			{
+				ScopedLock lock(lock_);
+				if (queue_.empty()) {
+					// Set under the lock, so nobody can add patches we would not send anymore
+					finished_ = true;
+					break;
+				}
+				if (bankSendCapability && (int)queue_.size() >= bankSize) {
+					// The whole bank is to be sent, one bank dump is much faster than many program dumps
+					batch = std::move(queue_);
+					queue_.clear();
+				}
+				else {
+					batch.insert(*queue_.begin());
+					queue_.erase(queue_.begin());
+				}
+			}
+
+			bool ok = batch.size() > 1 ? sendAsBankDump(batch) : sendAsProgramDump(batch.begin()->second);
+			if (!ok) {
+				{
+					ScopedLock lock(lock_);
+					finished_ = true;
+				}
+				finish(false);
+				return;
+			}
+			for (auto const &patch : batch) {
+				reportPatchSent(patch.second.patchNumber());
+			}
+
+			if (progressHandler_) {
+				ScopedLock lock(lock_);
+				sent_ += (int)batch.size();
+				progressHandler_->setProgressPercentage(sent_ / (double)std::max(1, total_));
+				if (progressHandler_->shouldAbort()) {
+					SimpleLogger::instance()->postMessage("Canceled bank upload in mid-flight!");
+					finished_ = true;
+					queue_.clear();
+					finish(false);
+					return;
+				}
+			}
+		}
+		finish(true);
+	}
+
+	bool BankUpload::sendAsBankDump(std::map<int, PatchHolder> const &patches)
+	{
+		auto programDumpCapability = midikraft::Capability::hasCapability<ProgramDumpCabability>(synth_);
+		auto bankSendCapability = midikraft::Capability::hasCapability<BankSendCapability>(synth_);
+		auto location = midikraft::Capability::hasCapability<MidiLocationCapability>(synth_);
+		if (!programDumpCapability || !bankSendCapability || !location) {
+			return false;
+		}
+		if (progressHandler_) progressHandler_->setMessage(fmt::format("Sending {} to {}", SynthBank::friendlyBankName(synth_, bankNo_), synth_->getName()));
+		std::vector<std::vector<MidiMessage>> programDumps;
+		for (auto const &patch : patches) {
+			programDumps.push_back(programDumpCapability->patchToProgramDumpSysex(patch.second.patch(), patch.second.patchNumber()));
+		}
+		auto messages = bankSendCapability->createBankMessages(programDumps);
+		size_t bytes = 0;
+		for (auto const &message : messages) {
+			bytes += (size_t) message.getRawDataSize();
+		}
+		double sendStarted = Time::getMillisecondCounterHiRes();
+		send(location->midiOutput(), messages);
+		waitForSynth(bytes, sendStarted);
+		return true;
+	}
+
+	bool BankUpload::sendAsProgramDump(PatchHolder const &patch)
+	{
+		auto programDumpCapability = midikraft::Capability::hasCapability<ProgramDumpCabability>(synth_);
+		auto location = midikraft::Capability::hasCapability<MidiLocationCapability>(synth_);
+		if (!programDumpCapability || !location) {
+			SimpleLogger::instance()->postMessage(fmt::format("Sending banks to {} is not implemented yet", synth_->getName()));
+			return false;
+		}
+		if (progressHandler_) progressHandler_->setMessage(fmt::format("Sending patch {} to {}", patch.name(), synth_->friendlyProgramName(patch.patchNumber())));
+		auto messages = programDumpCapability->patchToProgramDumpSysex(patch.patch(), patch.patchNumber());
+		size_t bytes = 0;
+		for (auto const &message : messages) {
+			bytes += (size_t) message.getRawDataSize();
+		}
+		double sendStarted = Time::getMillisecondCounterHiRes();
+		send(location->midiOutput(), messages);
+		waitForSynth(bytes, sendStarted);
+		return true;
+	}
+
+	void BankUpload::send(MidiDeviceInfo const &output, std::vector<MidiMessage> const &messages)
+	{
+		if (standIn_) {
+			standIn_->requestSent(messages);
+		}
+		else {
+			synth_->sendBlockOfMessagesToSynth(output, messages);
+		}
+	}
+
+	void BankUpload::waitForSynth(size_t bytesSent, double sendStarted)
+	{
+		// The messages need to get through to the synth before we send more, else they pile up in the driver's buffers.
+		// How long the output took to take them is what the synth or interface accepts, the pacing learns the speed from that.
+		// If the send throttled already, we don't wait twice. On top comes the pause the synth needs to store a patch.
+		double elapsed = Time::getMillisecondCounterHiRes() - sendStarted;
+		if (!standIn_) {
+			pacing_.transferSent(bytesSent, elapsed);
+		}
+		int wait = std::max(0, pacing_.transferTimeMs(bytesSent) - (int)elapsed) + pacing_.delayBeforeNextRequestMs();
+		if (wait > 0) {
+			Thread::sleep(wait);
+		}
+	}
+
+	void BankUpload::reportPatchSent(MidiProgramNumber program)
+	{
+		std::vector<TPatchSentHandler> handlers;
+		{
+			ScopedLock lock(lock_);
+			handlers = onPatchSent_;
+		}
+		if (!handlers.empty()) {
+			MessageManager::callAsync([handlers, program]() {
+				for (auto const &handler : handlers) {
+					handler(program);
+				}
+			});
+		}
+	}
+
+	void BankUpload::finish(bool completed)
+	{
+		if (!standIn_) {
+			// The stand-in's timing says nothing about the real synth
+			pacing_.persist();
+		}
+		std::vector<TFinishedHandler> handlers;
+		{
+			ScopedLock lock(lock_);
+			handlers = onFinished_;
+		}
+		if (!handlers.empty()) {
+			MessageManager::callAsync([handlers, completed]() {
+				for (auto const &handler : handlers) {
+					handler(completed);
+				}
+			});
+		}
+	}
+
+}
@@ -0,0 +1,71 @@
+/*
+   Copyright (c) 2020 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#pragma once
+
+#include "JuceHeader.h"
+
+#include "PatchHolder.h"
+#include "ProgressHandler.h"
+#include "ThrottledProgress.h"
+#include "MidiBankNumber.h"
+#include "RequestPacing.h"
+#include "MidiStandIn.h"
+
+#include <map>
+
+namespace midikraft {
+
+	class Synth;
+
+	// Sends the patches of a bank to the synth on a worker thread. If the synth can take a whole bank in one transfer and all positions
+	// are to be sent, it gets a bank dump, else one program dump per position, paced to not overrun the synth's input buffer.
+	// Patches added while the upload is running are merged into it, a position queued twice is sent only once with the latest patch.
+	// The handlers and the progress handler are called on the message thread.
+	class BankUpload {
+	public:
+		typedef std::function<void(MidiProgramNumber)> TPatchSentHandler;
+		typedef std::function<void(bool completed)> TFinishedHandler;
+
+		BankUpload(std::shared_ptr<Synth> synth, MidiBankNumber bankNo, std::shared_ptr<ProgressHandler> progressHandler);
+
+		// Queues the patches by their position in the bank, the handlers are called in addition to those of earlier calls.
+		// Returns false if the upload has already finished, then a new one is needed
+		bool addPatches(std::map<int, PatchHolder> const &patchesByPosition, TPatchSentHandler onPatchSent, TFinishedHandler onFinished);
+
+		// Call before running. The patches go to the stand-in instead of the synth's MIDI output
+		void sendTo(std::shared_ptr<MidiStandIn> standIn);
+
+		// Runs until the queue is empty or the user cancels
+		void run();
+
+		static std::string uploadKey(std::shared_ptr<Synth> synth, MidiBankNumber bankNo);
+
+	private:
+		bool sendAsBankDump(std::map<int, PatchHolder> const &patches);
+		bool sendAsProgramDump(PatchHolder const &patch);
+		void send(MidiDeviceInfo const &output, std::vector<MidiMessage> const &messages);
+		void waitForSynth(size_t bytesSent, double sendStarted);
+		void reportPatchSent(MidiProgramNumber program);
+		void finish(bool completed);
+
+		std::shared_ptr<Synth> synth_;
+		MidiBankNumber bankNo_;
+		std::unique_ptr<ProgressHandler> messageThreadProgress_; // Shares the progress handler given to us, the upload outlives the call that started it
+		std::unique_ptr<ThrottledProgress> progressHandler_; // In front of it, so the upload doesn't flood the message thread
+		RequestPacing pacing_;
+		std::shared_ptr<MidiStandIn> standIn_;
+
+		CriticalSection lock_;
+		std::vector<TPatchSentHandler> onPatchSent_;
+		std::vector<TFinishedHandler> onFinished_;
+		std::map<int, PatchHolder> queue_;
+		int total_;
+		int sent_;
+		bool finished_;
+	};
+
+}
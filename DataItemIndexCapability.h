@@ -0,0 +1,21 @@
+/*
+   Copyright (c) 2020 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#pragma once
+
+#include "JuceHeader.h"
+
+namespace midikraft {
+
+	// Optional for a DataFileLoadCapability - tells which item a data file message belongs to. With several requests in flight this
+	// allows the answers to arrive in any order. Without it, the answers are assumed to arrive in the order of the requests.
+	class DataItemIndexCapability {
+	public:
+		virtual ~DataItemIndexCapability() = default;
+		virtual int dataItemIndex(MidiMessage const &message, int dataTypeID) const = 0;
+	};
+
+}
@@ -0,0 +1,111 @@
+/*
+   Copyright (c) 2020 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#include "DirectoryScanCache.h"
+
+#include "MappedPatchFile.h"
+#include "Logger.h"
+
+#include "fmt/format.h"
+
+namespace midikraft {
+
+	DirectoryScanCache::DirectoryScanCache(File const &cacheFile) : file_(cacheFile)
+	{
+		if (!file_.existsAsFile()) {
+			return;
+		}
+		// One file per line: size, modification time, content hash, fingerprints separated by commas and the path, separated by tabs
+		StringArray lines;
+		lines.addLines(file_.loadFileAsString());
+		for (auto const &line : lines) {
+			StringArray parts;
+			parts.addTokens(line, "\t", "");
+			if (parts.size() < 5) {
+				// Empty or broken line
+				continue;
+			}
+			Entry entry;
+			entry.size = parts[0].getLargeIntValue();
+			entry.modified = parts[1].getLargeIntValue();
+			entry.contentHash = parts[2].toStdString();
+			if (parts[3] != "-") {
+				StringArray fingerprints;
+				fingerprints.addTokens(parts[3], ",", "");
+				for (auto const &fingerprint : fingerprints) {
+					entry.fingerprints.push_back(fingerprint.toStdString());
+				}
+			}
+			entries_[parts[4].toStdString()] = entry;
+		}
+	}
+
+	bool DirectoryScanCache::save() const
+	{
+		String text;
+		{
+			ScopedLock lock(lock_);
+			for (auto const &cached : entries_) {
+				std::string fingerprints;
+				for (auto const &fingerprint : cached.second.fingerprints) {
+					fingerprints += (fingerprints.empty() ? "" : ",") + fingerprint;
+				}
+				text += fmt::format("{}\t{}\t{}\t{}\t{}\n", cached.second.size, cached.second.modified, cached.second.contentHash,
+					fingerprints.empty() ? "-" : fingerprints, cached.first);
+			}
+		}
+		if (!file_.replaceWithText(text)) {
+			SimpleLogger::instance()->postMessage("Failed to write directory scan cache to " + file_.getFullPathName());
+			return false;
+		}
+		return true;
+	}
+
+	bool DirectoryScanCache::lookup(std::string const &path, Entry &entry) const
+	{
+		ScopedLock lock(lock_);
+		auto found = entries_.find(path);
+		if (found == entries_.end()) {
+			return false;
+		}
+		entry = found->second;
+		return true;
+	}
+
+	void DirectoryScanCache::update(std::string const &path, Entry const &entry)
+	{
+		ScopedLock lock(lock_);
+		entries_[path] = entry;
+	}
+
+	void DirectoryScanCache::remove(std::string const &path)
+	{
+		ScopedLock lock(lock_);
+		entries_.erase(path);
+	}
+
+	std::vector<std::string> DirectoryScanCache::pathsBelow(File const &directory) const
+	{
+		std::vector<std::string> result;
+		ScopedLock lock(lock_);
+		for (auto const &cached : entries_) {
+			if (File(cached.first).isAChildOf(directory)) {
+				result.push_back(cached.first);
+			}
+		}
+		return result;
+	}
+
+	std::string DirectoryScanCache::contentHash(File const &file)
+	{
+		MappedPatchFile mapped(file);
+		if (!mapped.isOpen()) {
+			return "";
+		}
+		return MD5(mapped.data(), mapped.size()).toHexString().toStdString();
+	}
+
+}
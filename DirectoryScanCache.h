@@ -0,0 +1,53 @@
+/*
+   Copyright (c) 2020 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#pragma once
+
+#include "JuceHeader.h"
+
+#include "PatchHolder.h"
+
+namespace midikraft {
+
+	// What the last import of a directory tree found in every file, so a rescan only opens the files that are new or changed
+	class DirectoryScanCache {
+	public:
+		struct Entry {
+			int64 size = 0;
+			int64 modified = 0; // Milliseconds since 1970
+			std::string contentHash;
+			std::vector<std::string> fingerprints; // Of the patches in the file, including those already in the database
+		};
+
+		// Loads the cache from the file if it exists, save() writes it back
+		explicit DirectoryScanCache(File const &cacheFile);
+		bool save() const;
+
+		bool lookup(std::string const &path, Entry &entry) const;
+		void update(std::string const &path, Entry const &entry);
+		void remove(std::string const &path);
+		// The files cached in this directory or any directory below
+		std::vector<std::string> pathsBelow(File const &directory) const;
+
+		static std::string contentHash(File const &file);
+
+	private:
+		File file_;
+		mutable CriticalSection lock_;
+		std::map<std::string, Entry> entries_;
+	};
+
+	// The outcome of a rescan of a directory tree
+	struct DirectoryRescan {
+		std::vector<PatchHolder> patches; // From the new and modified files
+		std::vector<std::string> newFiles;
+		std::vector<std::string> modifiedFiles;
+		std::vector<std::string> removedFiles;
+		int unchangedFiles = 0;
+		bool completed = true;
+	};
+
+}
@@ -0,0 +1,56 @@
+/*
+   Copyright (c) 2020 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#include "DownloadCheckpoint.h"
+
+#include "fmt/format.h"
+
+namespace midikraft {
+
+	void DownloadCheckpoint::patchCompleted(int slot, std::vector<MidiMessage> const &messages)
+	{
+		ScopedLock lock(lock_);
+		completed_[slot] = messages;
+	}
+
+	bool DownloadCheckpoint::hasPatch(int slot) const
+	{
+		ScopedLock lock(lock_);
+		return completed_.find(slot) != completed_.end();
+	}
+
+	std::map<int, std::vector<MidiMessage>> DownloadCheckpoint::completedPatches() const
+	{
+		ScopedLock lock(lock_);
+		return completed_;
+	}
+
+	size_t DownloadCheckpoint::size() const
+	{
+		ScopedLock lock(lock_);
+		return completed_.size();
+	}
+
+	void DownloadCheckpoint::clear()
+	{
+		ScopedLock lock(lock_);
+		completed_.clear();
+	}
+
+	std::shared_ptr<DownloadCheckpoint> DownloadCheckpoints::checkpoint(std::string const &synthName, MidiBankNumber bankNo)
+	{
+		ScopedLock lock(lock_);
+		auto key = fmt::format("{}-{}", synthName, bankNo.toZeroBased());
+		auto found = checkpoints_.find(key);
+		if (found != checkpoints_.end()) {
+			return found->second;
+		}
+		auto checkpoint = std::make_shared<DownloadCheckpoint>();
+		checkpoints_[key] = checkpoint;
+		return checkpoint;
+	}
+
+}
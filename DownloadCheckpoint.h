@@ -0,0 +1,44 @@
+/*
+   Copyright (c) 2020 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#pragma once
+
+#include "JuceHeader.h"
+
+#include "MidiBankNumber.h"
+
+#include <map>
+
+namespace midikraft {
+
+	// The patches of one bank that have been downloaded completely, as the raw messages received per program slot.
+	// A download that is aborted or runs into a lost message can resume at the first missing program instead of starting over.
+	class DownloadCheckpoint {
+	public:
+		void patchCompleted(int slot, std::vector<MidiMessage> const &messages);
+		bool hasPatch(int slot) const;
+		std::map<int, std::vector<MidiMessage>> completedPatches() const;
+		size_t size() const;
+
+		// The bank has been downloaded completely, nothing to resume anymore
+		void clear();
+
+	private:
+		CriticalSection lock_;
+		std::map<int, std::vector<MidiMessage>> completed_;
+	};
+
+	// All checkpoints of the running application, by synth and bank
+	class DownloadCheckpoints {
+	public:
+		std::shared_ptr<DownloadCheckpoint> checkpoint(std::string const &synthName, MidiBankNumber bankNo);
+
+	private:
+		CriticalSection lock_;
+		std::map<std::string, std::shared_ptr<DownloadCheckpoint>> checkpoints_;
+	};
+
+}
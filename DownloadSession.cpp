@@ -0,0 +1,1133 @@
+/*
+   Copyright (c) 2020 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#include "DownloadSession.h"
+
+#include "Librarian.h"
+#include "Synth.h"
+#include "SynthBank.h"
+#include "HasBanksCapability.h"
+#include "BankDumpCapability.h"
+#include "EditBufferCapability.h"
+#include "ProgramDumpCapability.h"
+#include "StreamLoadCapability.h"
+#include "HandshakeLoadingCapability.h"
+#include "SendsProgramChangeCapability.h"
+#include "DataItemIndexCapability.h"
+
+#include "RunWithRetry.h"
+
+#include "fmt/format.h"
+
+namespace midikraft {
+
+	DownloadSession::DownloadSession(std::shared_ptr<SafeMidiOutput> midiOutput, ProgressHandler *progressHandler, TSessionEndedHandler onSessionEnded, ThreadPool *parser /* = nullptr */) :
+		midiOutput_(midiOutput), progressHandler_(progressHandler), onSessionEnded_(onSessionEnded), ended_(false), currentDownloadBank_(MidiBankNumber::invalid()),
+		parser_(parser), downloadNumber_(0), startDownloadNumber_(0), endDownloadNumber_(0), expectedDownloadNumber_(0), downloadBankNumber_(0), isBulkImport_(false)
+	{
+		if (progressHandler) {
+			// The handlers report progress for every message, which is way more than the UI needs
+			throttledProgress_ = std::make_unique<ThrottledProgress>(progressHandler, ThrottledProgress::updatesPerSecondSetting());
+			progressHandler_ = throttledProgress_.get();
+		}
+	}
+
+	DownloadSession::~DownloadSession()
+	{
+		clearHandlers();
+	}
+
+	class CollectingSink : public DownloadSink {
+	public:
+		CollectingSink(DownloadSession::TFinishedHandler onFinished) : onFinished_(onFinished) {}
+
+		virtual void bankDownloaded(MidiBankNumber bankNo, std::vector<PatchHolder> &&patches) override {
+			ignoreUnused(bankNo);
+			if (result_.empty()) {
+				result_ = std::move(patches);
+			}
+			else {
+				std::move(patches.begin(), patches.end(), std::back_inserter(result_));
+			}
+		}
+
+		virtual void downloadFinished(bool completed) override {
+			if (completed) {
+				onFinished_(std::move(result_));
+			}
+		}
+
+	private:
+		DownloadSession::TFinishedHandler onFinished_;
+		std::vector<PatchHolder> result_;
+	};
+
+	void DownloadSession::startDownloadingAllPatches(std::shared_ptr<Synth> synth, std::vector<MidiBankNumber> bankNo, TFinishedHandler onFinished, TPatchLoadedHandler onPatchLoaded /* = nullptr */)
+	{
+		startDownloadingAllPatches(synth, bankNo, std::make_shared<CollectingSink>(onFinished), onPatchLoaded);
+	}
+
+	void DownloadSession::startDownloadingAllPatches(std::shared_ptr<Synth> synth, std::vector<MidiBankNumber> bankNo, std::shared_ptr<DownloadSink> sink, TPatchLoadedHandler onPatchLoaded /* = nullptr */)
+	{
+		downloadBankNumber_ = 0;
+		onPatchLoaded_ = onPatchLoaded;
+		{
+			ScopedLock lock(sinkLock_);
+			sink_ = sink;
+		}
+		// With more than one bank, all patches are tagged with one bulk import source
+		isBulkImport_ = bankNo.size() > 1;
+		bulkImportTime_ = Time::getCurrentTime();
+		if (!bankNo.empty()) {
+			nextBankHandler_ = [this, synth, bankNo](std::vector<midikraft::PatchHolder> patchesLoaded) {
+				bool lastBank;
+				{
+					// An abort on the message thread takes the sink under this lock, so it can't report the end in between
+					ScopedLock lock(sinkLock_);
+					if (sink_) {
+						sink_->bankDownloaded(bankNo[downloadBankNumber_], std::move(patchesLoaded));
+					}
+					downloadBankNumber_++;
+					lastBank = downloadBankNumber_ == bankNo.size();
+					if (lastBank && sink_) {
+						auto sink = std::move(sink_);
+						sink->downloadFinished(true);
+					}
+				}
+				if (lastBank) {
+					endSession();
+				}
+				else {
+					// We are on the parser thread here, register the handlers and send the next request from the message thread like the first one
+					auto self = shared_from_this();
+					MessageManager::callAsync([self, synth, bankNo]() {
+						if (self->hasEnded()) {
+							return;
+						}
+						if (!self->progressHandler_->shouldAbort()) {
+							self->progressHandler_->setMessage(fmt::format("Importing {} from {}...", SynthBank::friendlyBankName(synth, bankNo[self->downloadBankNumber_]), synth->getName()));
+							self->startDownloadingBank(synth, bankNo[self->downloadBankNumber_], self->nextBankHandler_);
+						}
+						else {
+							self->endSession();
+						}
+					});
+				}
+			};
+			progressHandler_->setMessage(fmt::format("Importing {} from {}...", SynthBank::friendlyBankName(synth, bankNo[0]), synth->getName()));
+			startDownloadingBank(synth, bankNo[0], nextBankHandler_);
+		}
+		else {
+			endSession();
+		}
+	}
+
+	void DownloadSession::startDownloadingBank(std::shared_ptr<Synth> synth, MidiBankNumber bankNo, TFinishedHandler onFinished)
+	{
+		// First things first - there should be no other callback handlers of this session be registered!
+		jassert(handles_.empty());
+		clearHandlers();
+
+		// Ok, for this we need to send a program change message, and then a request edit buffer message from the active synth
+		// Once we get that, store the patch and increment number by one
+		downloadNumber_ = 0;
+		startDownloadNumber_ = 0;
+		currentDownload_.clear();
+		onFinished_ = onFinished;
+		importTime_ = Time::getCurrentTime();
+		checkpoint_.reset();
+
+		// Determine what we will do with the answer...
+		resolveCapabilities(synth);
+		auto handle = MidiController::makeOneHandle();
+		auto streamLoading = caps_.streamLoading;
+		auto bankCapableSynth = caps_.bankDump;
+		auto handshakeLoadingRequired = caps_.handshakeLoading;
+		if (streamLoading) {
+			// Simple enough, we hope
+			addHandler(handle, [this](MidiInput *source, const juce::MidiMessage &editBuffer) {
+				ignoreUnused(source);
+				this->handleNextStreamPart(editBuffer, StreamLoadCapability::StreamType::BANK_DUMP);
+			});
+			startStatistics(synth->getName(), "stream");
+			currentDownloadBank_ = bankNo;
+			expectedDownloadNumber_ = SynthBank::numberOfPatchesInBank(synth, bankNo);
+			currentDownload_.reserve((size_t)std::max(0, expectedDownloadNumber_));
+			if (expectedDownloadNumber_ > 0) {
+				auto messages = streamLoading->requestStreamElement(bankNo.toZeroBased(), StreamLoadCapability::StreamType::BANK_DUMP);
+				recordRequestSent();
+				sendToSynth(synth.get(), messages);
+			}
+		}
+		else if (handshakeLoadingRequired) {
+			// These are proper protocols that are implemented - each message we get from the synth has to be answered by an appropriate next message
+			std::shared_ptr<HandshakeLoadingCapability::ProtocolState>  state = handshakeLoadingRequired->createStateObject();
+			if (state) {
+				addHandler(handle, [this, handshakeLoadingRequired, state, synth, bankNo](MidiInput *source, const juce::MidiMessage &protocolMessage) {
+					ignoreUnused(source);
+					std::vector<MidiMessage> answer;
+					if (handshakeLoadingRequired->isNextMessage(protocolMessage, answer, state)) {
+						// Store message
+						recordMessageReceived(protocolMessage);
+						currentDownload_.push_back(protocolMessage);
+					}
+					// Send an answer if the handshake handler constructed one
+					if (!answer.empty()) {
+						sendToSynth(synth.get(), answer);
+					}
+					// Update progress handler
+					progressHandler_->setProgressPercentage(state->progress());
+
+					// Stop handler when finished
+					if (state->isFinished() || progressHandler_->shouldAbort()) {
+						clearHandlers();
+						if (state->wasSuccessful()) {
+							// Parse patches and send them back
+							parseInBackground(synth, std::move(currentDownload_), startDownloadNumber_, bankNo);
+							currentDownload_.clear();
+							finishInBackground();
+						}
+						else {
+							progressHandler_->onCancel();
+							endSession();
+						}
+					}
+				});
+				startStatistics(synth->getName(), "handshake");
+				recordRequestSent();
+				// The synth implementation sends the first request itself, bypassing sendToSynth
+				if (trafficLog_) {
+					trafficLog_->recordHandshakeStart();
+				}
+				if (replay_) {
+					replay_->handshakeStarted();
+				}
+				else {
+					handshakeLoadingRequired->startDownload(midiOutput_, state);
+				}
+			}
+			else {
+				jassert(false);
+				endSession();
+			}
+		}
+		else if (bankCapableSynth) {
+			// This is a mixture - you send one message (bank request), and then you get either one message back (like Kawai K3) or a stream of messages with
+			// one message per patch (e.g. Access Virus or Matrix1000)
+			auto buffer = bankCapableSynth->requestBankDump(bankNo);
+			pacing_ = std::make_shared<RequestPacing>(synth, RequestPacing::Mode::BANK_DUMP);
+			auto pacing = pacing_;
+			auto self = shared_from_this(); // The retry might fire after the Librarian has let go of this session
+			startStatistics(synth->getName(), "bank dump");
+			RunWithRetry::start([self, synth, buffer, bankNo, pacing]() {
+					self->expectedDownloadNumber_ = SynthBank::numberOfPatchesInBank(synth, bankNo);
+					pacing->requestSent();
+					self->recordRequestSent();
+					self->sendToSynth(synth.get(), buffer);
+					},
+				[self, pacing]() {
+					bool retry = !self->hasEnded() && self->currentDownload_.empty();
+					if (retry) {
+						pacing->requestTimedOut();
+						self->recordRetry();
+					}
+					return retry;
+				},
+				pacing->retries(),
+				pacing->timeoutMs(),
+				"initiating bank dump");
+
+			addHandler(handle, [this, bankNo](MidiInput *source, const juce::MidiMessage &editBuffer) {
+				ignoreUnused(source);
+				this->handleNextBankDump(editBuffer, bankNo);
+			});
+			currentDownload_.clear();
+			currentDownload_.reserve((size_t)std::max(0, SynthBank::numberOfPatchesInBank(synth, bankNo))); // Synths sending one message per patch
+		}
+		else {
+			// Uh, stone age, need to start a loop
+			auto editBufferCapability = caps_.editBuffer;
+			auto programDumpCapability = caps_.programDump;
+			if (programDumpCapability) {
+				addHandler(handle, [this, bankNo](MidiInput* source, const juce::MidiMessage& editBuffer) {
+					ignoreUnused(source);
+					this->handleNextProgramBuffer(editBuffer, bankNo);
+				});
+				downloadNumber_ = SynthBank::startIndexInBank(synth, bankNo);
+				startDownloadNumber_ = downloadNumber_;
+				endDownloadNumber_ = downloadNumber_ + SynthBank::numberOfPatchesInBank(synth, bankNo);
+				currentProgramDump_.clear();
+				receivedPrograms_.clear();
+				pacing_ = std::make_shared<RequestPacing>(synth, RequestPacing::Mode::PROGRAM_DUMP);
+				startStatistics(synth->getName(), "program dumps");
+				resumeFromCheckpoint(synth, bankNo);
+				if (!onlyPrograms_.empty()) {
+					// Treat the programs we don't want like those already received
+					for (int program = startDownloadNumber_; program < endDownloadNumber_; program++) {
+						if (onlyPrograms_.find(program) == onlyPrograms_.end()) {
+							receivedPrograms_.insert(program);
+						}
+					}
+				}
+				if ((int) receivedPrograms_.size() >= endDownloadNumber_ - startDownloadNumber_) {
+					// Everything was there already
+					clearHandlers();
+					finishInBackground();
+					return;
+				}
+				// Fill the request window, every completed dump will then trigger the next request
+				int window = Librarian::downloadWindowSize(synth);
+				for (int i = 0; i < window && downloadNumber_ < endDownloadNumber_; i++) {
+					startDownloadNextPatch(synth);
+				}
+			}
+			else if (editBufferCapability) {
+				addHandler(handle, [this, bankNo](MidiInput* source, const juce::MidiMessage& editBuffer) {
+					ignoreUnused(source);
+					this->handleNextEditBuffer(editBuffer, bankNo);
+				});
+				downloadNumber_ = SynthBank::startIndexInBank(synth, bankNo);
+				startDownloadNumber_ = downloadNumber_;
+				endDownloadNumber_ = downloadNumber_ + SynthBank::numberOfPatchesInBank(synth, bankNo);
+				receivedPrograms_.clear();
+				pacing_ = std::make_shared<RequestPacing>(synth, RequestPacing::Mode::EDIT_BUFFER);
+				startStatistics(synth->getName(), "edit buffers");
+				resumeFromCheckpoint(synth, bankNo);
+				if (!onlyPrograms_.empty()) {
+					// Skip the programs we don't want like those already received
+					for (int program = startDownloadNumber_; program < endDownloadNumber_; program++) {
+						if (onlyPrograms_.find(program) == onlyPrograms_.end()) {
+							receivedPrograms_.insert(program);
+						}
+					}
+				}
+				skipCheckpointedPrograms();
+				if (downloadNumber_ >= endDownloadNumber_) {
+					// Everything was there already
+					clearHandlers();
+					finishInBackground();
+					return;
+				}
+				startDownloadNextEditBuffer(synth, true);
+			}
+			else {
+				SimpleLogger::instance()->postMessage("Error: This synth has not implemented a single method to retrieve a bank. Please consult the documentation!");
+				endSession();
+			}
+		}
+	}
+
+	void DownloadSession::downloadEditBuffer(std::shared_ptr<Synth> synth, TFinishedHandler onFinished)
+	{
+		// First things first - there should be no other callback handlers of this session be registered!
+		jassert(handles_.empty());
+		clearHandlers();
+
+		// Ok, for this we need to send a program change message, and then a request edit buffer message from the active synth
+		// Once we get that, store the patch and increment number by one
+		downloadNumber_ = 0;
+		startDownloadNumber_ = 0;
+		currentDownload_.clear();
+		importTime_ = Time::getCurrentTime();
+		checkpoint_.reset(); // A single edit buffer is not worth resuming
+		onFinished_ = [this, onFinished](std::vector<PatchHolder> patches) {
+			onFinished(patches);
+			endSession();
+		};
+		resolveCapabilities(synth);
+		auto editBufferCapability = caps_.editBuffer;
+		auto streamLoading = caps_.streamLoading;
+		auto programDumpCapability = caps_.programDump;
+		auto programChangeCapability = caps_.programChange;
+		auto handle = MidiController::makeOneHandle();
+		startStatistics(synth->getName(), "edit buffer");
+		if (streamLoading) {
+			// Simple enough, we hope
+			addHandler(handle, [this](MidiInput *source, const juce::MidiMessage &editBuffer) {
+				ignoreUnused(source);
+				this->handleNextStreamPart(editBuffer, StreamLoadCapability::StreamType::EDIT_BUFFER_DUMP);
+			});
+			currentDownload_.clear();
+			auto messages = streamLoading->requestStreamElement(0, StreamLoadCapability::StreamType::EDIT_BUFFER_DUMP);
+			recordRequestSent();
+			sendToSynth(synth.get(), messages);
+		} else if (editBufferCapability) {
+			auto firstBank = MidiBankNumber::fromZeroBase(0, SynthBank::numberOfPatchesInBank(synth, 0));
+			addHandler(handle, [this, firstBank](MidiInput *source, const juce::MidiMessage &editBuffer) {
+				ignoreUnused(source);
+				this->handleNextEditBuffer(editBuffer, firstBank);
+			});
+			pacing_.reset();
+			// Special case - load only a single patch. In this case we're interested in the edit buffer only!
+			startDownloadNumber_ = 0;
+			endDownloadNumber_ = 1;
+			startDownloadNextEditBuffer(synth, false); // No program change required, we want exactly one edit buffer, the current one
+		}
+		else if (programDumpCapability && programChangeCapability) {
+			auto messages = programDumpCapability->requestPatch(programChangeCapability->lastProgramChange().toZeroBased());
+			sendToSynth(synth.get(), messages);
+			endSession();
+		}
+		else {
+			SimpleLogger::instance()->postMessage("The " + synth->getName() + " has no way to request the edit buffer or program place");
+			endSession();
+		}
+	}
+
+	void DownloadSession::startDownloadingSequencerData(DataFileLoadCapability *sequencer, int dataFileIdentifier, int windowSize, TStepSequencerFinishedHandler onFinished)
+	{
+		// First things first - there should be no other callback handlers of this session be registered!
+		jassert(handles_.empty());
+		clearHandlers();
+
+		downloadNumber_ = 0;
+		currentDownload_.clear();
+		sequencerItems_.clear();
+		itemsInFlight_.clear();
+		onSequencerFinished_ = onFinished;
+
+		auto handle = MidiController::makeOneHandle();
+		auto device = dynamic_cast<NamedDeviceCapability *>(sequencer);
+		startStatistics(device ? device->getName() : "sequencer", "sequencer data");
+		int numberOfItems = sequencer->numberOfDataItemsPerType(dataFileIdentifier);
+		auto itemIndex = dynamic_cast<DataItemIndexCapability *>(sequencer);
+		auto location = dynamic_cast<MidiLocationCapability *>(sequencer);
+		inputIdentifier_ = location ? location->midiInput().identifier : String();
+		addHandler(handle, [this, sequencer, dataFileIdentifier, numberOfItems, itemIndex](MidiInput *source, const MidiMessage &message) {
+			ignoreUnused(source);
+			if (sequencer->isDataFile(message, dataFileIdentifier)) {
+				recordMessageReceived(message);
+				// Which request is this the answer to? If the sequencer can't tell us, it is the oldest one
+				int index = itemIndex ? itemIndex->dataItemIndex(message, dataFileIdentifier) : -1;
+				if (index >= numberOfItems) {
+					// Not an item of this download, it must not count towards completing it
+					return;
+				}
+				auto request = std::find_if(itemsInFlight_.begin(), itemsInFlight_.end(), [index](std::pair<int, double> const &inFlight) { return inFlight.first == index; });
+				if (index < 0) {
+					request = itemsInFlight_.begin();
+				}
+				if (request != itemsInFlight_.end()) {
+					index = request->first;
+					recordRoundTrip(Time::getMillisecondCounterHiRes() - request->second);
+					itemsInFlight_.erase(request);
+				}
+				else if (index < 0 || sequencerItems_.find(index) != sequencerItems_.end()) {
+					// Unrequested, and we can't place it
+					return;
+				}
+				sequencerItems_[index] = message;
+
+				if ((int) sequencerItems_.size() >= numberOfItems) {
+					// Put them back into the order of the items
+					currentDownload_.clear();
+					for (auto const &item : sequencerItems_) {
+						currentDownload_.push_back(item.second);
+					}
+					sequencerItems_.clear();
+					double parseStart = Time::getMillisecondCounterHiRes();
+					auto loadedData = sequencer->loadData(currentDownload_, dataFileIdentifier);
+					recordParsed((int)loadedData.size(), Time::getMillisecondCounterHiRes() - parseStart, 0.0);
+					recordFinished(true);
+					clearHandlers();
+					logStatistics();
+					onSequencerFinished_(loadedData);
+					if (progressHandler_) progressHandler_->onSuccess();
+					endSession();
+				}
+				else if (progressHandler_ && progressHandler_->shouldAbort()) {
+					clearHandlers();
+					progressHandler_->onCancel();
+					endSession();
+				}
+				else {
+					// Keep the window filled
+					if (downloadNumber_ < numberOfItems) {
+						startDownloadNextDataItem(sequencer, dataFileIdentifier);
+					}
+					if (progressHandler_) progressHandler_->setProgressPercentage(sequencerItems_.size() / (double)numberOfItems);
+				}
+			}
+		});
+		for (int i = 0; i < std::max(1, windowSize) && downloadNumber_ < numberOfItems; i++) {
+			startDownloadNextDataItem(sequencer, dataFileIdentifier);
+		}
+	}
+
+	void DownloadSession::startDownloadingPrograms(std::shared_ptr<Synth> synth, MidiBankNumber bankNo, std::set<int> const &programs, std::shared_ptr<DownloadSink> sink)
+	{
+		onlyPrograms_ = programs;
+		startDownloadingAllPatches(synth, { bankNo }, sink);
+	}
+
+	void DownloadSession::abort()
+	{
+		endSession();
+	}
+
+	bool DownloadSession::hasEnded() const
+	{
+		return ended_;
+	}
+
+	std::string DownloadSession::outputIdentifier() const
+	{
+		return midiOutput_ ? midiOutput_->deviceInfo().identifier.toStdString() : "";
+	}
+
+	DownloadStatistics DownloadSession::statistics() const
+	{
+		ScopedLock lock(statsLock_);
+		return stats_;
+	}
+
+	void DownloadSession::startStatistics(std::string const &synthName, std::string const &mode)
+	{
+		ScopedLock lock(statsLock_);
+		if (stats_.started == 0.0) {
+			stats_.started = Time::getMillisecondCounterHiRes();
+		}
+		stats_.synthName = synthName;
+		stats_.mode = mode;
+	}
+
+	void DownloadSession::recordRequestSent()
+	{
+		ScopedLock lock(statsLock_);
+		if (stats_.firstRequestSent == 0.0) {
+			stats_.firstRequestSent = Time::getMillisecondCounterHiRes();
+		}
+		stats_.requestsSent++;
+	}
+
+	void DownloadSession::recordRetry()
+	{
+		ScopedLock lock(statsLock_);
+		stats_.retries++;
+	}
+
+	void DownloadSession::recordMessageReceived(MidiMessage const &message)
+	{
+		ScopedLock lock(statsLock_);
+		double now = Time::getMillisecondCounterHiRes();
+		if (stats_.firstResponse == 0.0) {
+			stats_.firstResponse = now;
+		}
+		stats_.lastMessageReceived = now;
+		stats_.messagesReceived++;
+		stats_.bytesReceived += message.getRawDataSize();
+	}
+
+	void DownloadSession::recordParsed(int patches, double parseMs, double tagMs)
+	{
+		ScopedLock lock(statsLock_);
+		stats_.patches += patches;
+		stats_.parseMs += parseMs;
+		stats_.tagMs += tagMs;
+	}
+
+	void DownloadSession::recordRoundTrip(double roundTripMs)
+	{
+		ScopedLock lock(statsLock_);
+		stats_.roundTrips++;
+		stats_.roundTripMs += roundTripMs;
+	}
+
+	void DownloadSession::logStatistics() const
+	{
+		auto stats = statistics();
+		SimpleLogger::instance()->postMessage(fmt::format("Downloaded {} items from {} in {:.1f} s, {:.1f} items/s, average round trip {:.0f} ms",
+			stats.messagesReceived, stats.synthName, stats.durationMs() / 1000.0, stats.messagesReceived * 1000.0 / std::max(1.0, stats.durationMs()),
+			stats.averageRoundTripMs()));
+	}
+
+	void DownloadSession::recordFinished(bool completed)
+	{
+		ScopedLock lock(statsLock_);
+		stats_.finished = Time::getMillisecondCounterHiRes();
+		stats_.completed = completed;
+	}
+
+	DownloadCapabilities::DownloadCapabilities(std::shared_ptr<Synth> synth) : synth(synth)
+	{
+		streamLoading = midikraft::Capability::hasCapability<StreamLoadCapability>(synth);
+		handshakeLoading = midikraft::Capability::hasCapability<HandshakeLoadingCapability>(synth);
+		bankDump = midikraft::Capability::hasCapability<BankDumpCapability>(synth);
+		editBuffer = midikraft::Capability::hasCapability<EditBufferCapability>(synth);
+		programDump = midikraft::Capability::hasCapability<ProgramDumpCabability>(synth);
+		midiLocation = midikraft::Capability::hasCapability<MidiLocationCapability>(synth);
+		programChange = midikraft::Capability::hasCapability<SendsProgramChangeCapability>(synth);
+	}
+
+	void DownloadSession::resolveCapabilities(std::shared_ptr<Synth> synth)
+	{
+		// Once per download, the following banks reuse what we found
+		if (caps_.synth != synth) {
+			caps_ = DownloadCapabilities(synth);
+		}
+		inputIdentifier_ = caps_.midiLocation ? caps_.midiLocation->midiInput().identifier : String();
+	}
+
+	void DownloadSession::resumeWith(std::shared_ptr<DownloadCheckpoints> checkpoints)
+	{
+		checkpoints_ = checkpoints;
+	}
+
+	void DownloadSession::resumeFromCheckpoint(std::shared_ptr<Synth> synth, MidiBankNumber bankNo)
+	{
+		if (!checkpoints_ || !onlyPrograms_.empty()) {
+			// Reading back selected programs needs fresh data
+			return;
+		}
+		checkpoint_ = checkpoints_->checkpoint(synth->getName(), bankNo);
+		int resumed = 0;
+		for (auto &patch : checkpoint_->completedPatches()) {
+			if (patch.first >= startDownloadNumber_ && patch.first < endDownloadNumber_) {
+				receivedPrograms_.insert(patch.first);
+				parseInBackground(synth, std::move(patch.second), patch.first, bankNo);
+				resumed++;
+			}
+		}
+		if (resumed > 0) {
+			SimpleLogger::instance()->postMessage(fmt::format("Resuming download of {} from {}, {} patches were already received", SynthBank::friendlyBankName(synth, bankNo), synth->getName(), resumed));
+		}
+	}
+
+	void DownloadSession::skipCheckpointedPrograms()
+	{
+		while (downloadNumber_ < endDownloadNumber_ && receivedPrograms_.find(downloadNumber_) != receivedPrograms_.end()) {
+			downloadNumber_++;
+		}
+	}
+
+	void DownloadSession::runHandlersOn(std::shared_ptr<MidiWorker> worker)
+	{
+		worker_ = worker;
+	}
+
+	void DownloadSession::recordTo(std::shared_ptr<MidiTrafficLog> trafficLog)
+	{
+		trafficLog_ = trafficLog;
+	}
+
+	void DownloadSession::replayFrom(std::shared_ptr<MidiStandIn> replay)
+	{
+		replay_ = replay;
+	}
+
+	void DownloadSession::addHandler(MidiController::HandlerHandle const &handle, std::function<void(MidiInput *, MidiMessage const &)> handler)
+	{
+		// With a worker, the MIDI thread only queues the message and the handler runs on the worker thread
+		std::function<void(MidiInput *, MidiMessage const &)> receive = handler;
+		if (worker_) {
+			auto inbox = worker_->open([handler](MidiMessage const &message) { handler(nullptr, message); });
+			inboxes_.push_back(inbox);
+			receive = [inbox](MidiInput *source, MidiMessage const &message) {
+				ignoreUnused(source);
+				inbox->push(message);
+			};
+		}
+		auto trafficLog = trafficLog_;
+		auto inputIdentifier = inputIdentifier_;
+		auto recordingHandler = [trafficLog, receive, inputIdentifier](MidiInput *source, MidiMessage const &message) {
+			if (source && inputIdentifier.isNotEmpty() && source->getIdentifier() != inputIdentifier) {
+				// The handlers are registered for all inputs, this is meant for another session, maybe another unit of the same synth.
+				// Without a known input we have to listen to everything as before
+				return;
+			}
+			if (trafficLog) {
+				trafficLog->recordIncoming(message);
+			}
+			receive(source, message);
+		};
+		if (replay_) {
+			replay_->connect([recordingHandler](MidiMessage const &message) { recordingHandler(nullptr, message); });
+		}
+		else {
+			MidiController::instance()->addMessageHandler(handle, recordingHandler);
+		}
+		handles_.push(handle);
+	}
+
+	void DownloadSession::sendToSynth(Synth *synth, std::vector<MidiMessage> const &messages)
+	{
+		if (trafficLog_) {
+			trafficLog_->recordOutgoing(messages);
+		}
+		if (replay_) {
+			replay_->requestSent(messages);
+		}
+		else if (synth) {
+			// The synth knows how fast it can take the messages
+			synth->sendBlockOfMessagesToSynth(midiOutput_->deviceInfo(), messages);
+		}
+		else {
+			// This is not a synth... fall back to old behavior
+			midiOutput_->sendBlockOfMessagesFullSpeed(messages);
+		}
+	}
+
+	void DownloadSession::clearHandlers()
+	{
+		// This is to clear up any remaining MIDI callback handlers, e.g. on User canceling an operation
+		while (!handles_.empty()) {
+			auto handle = handles_.top();
+			handles_.pop();
+			if (replay_) {
+				replay_->disconnect();
+			}
+			else {
+				MidiController::instance()->removeMessageHandler(handle);
+			}
+		}
+		for (auto &inbox : inboxes_) {
+			worker_->close(inbox);
+		}
+		inboxes_.clear();
+	}
+
+	void DownloadSession::endSession()
+	{
+		clearHandlers();
+		{
+			ScopedLock lock(sinkLock_);
+			if (sink_) {
+				// The download did not complete
+				auto sink = std::move(sink_);
+				sink->downloadFinished(false);
+			}
+		}
+		if (!ended_.exchange(true)) {
+			{
+				ScopedLock lock(statsLock_);
+				if (stats_.finished == 0.0) {
+					// Ended without completing
+					stats_.finished = Time::getMillisecondCounterHiRes();
+				}
+			}
+			// Tell the Librarian, it might want to start the next session waiting for our MIDI output
+			if (onSessionEnded_) {
+				onSessionEnded_(this);
+			}
+		}
+	}
+
+	void DownloadSession::startDownloadNextEditBuffer(std::shared_ptr<Synth> synth, bool sendProgramChange) {
+		ScopedLock lock(editBufferLock_);
+		// Get all commands
+		std::vector<MidiMessage> messages;
+		auto editBufferCapability = caps_.editBuffer.get();
+		if (editBufferCapability) {
+			currentEditBuffer_.clear();
+			auto midiLocation = caps_.midiLocation.get();
+			if (midiLocation) {
+				if (sendProgramChange) {
+					messages.push_back(MidiMessage::programChange(midiLocation->channel().toOneBasedInt(), downloadNumber_));
+				}
+				auto requestMessages = editBufferCapability->requestEditBufferDump();
+				std::copy(requestMessages.cbegin(), requestMessages.cend(), std::back_inserter(messages));
+			}
+			else {
+				SimpleLogger::instance()->postMessage("Error: Can't send to synth because no MIDI location implemented for it");
+			}
+		}
+		else {
+			SimpleLogger::instance()->postMessage("Failure: This synth does not implement any valid capability to start downloading a full bank");
+			downloadNumber_ = endDownloadNumber_;
+		}
+
+		// Send messages
+		if (!messages.empty()) {
+			if (pacing_) {
+				// Send with the timeout learned for this synth, and retry if no answer arrives in time
+				auto pacing = pacing_;
+				int requestedNumber = downloadNumber_;
+				auto self = shared_from_this();
+				// The retries run on the message thread, while the answers are handled on the MIDI or worker thread
+				auto sendRequest = [self, synth, messages, pacing, requestedNumber]() {
+					{
+						ScopedLock lock(self->editBufferLock_);
+						if (self->hasEnded() || self->downloadNumber_ != requestedNumber) {
+							// Canceled or already answered while we were waiting
+							return;
+						}
+						self->currentEditBuffer_.clear();
+					}
+					pacing->requestSent();
+					self->recordRequestSent();
+					self->sendToSynth(synth.get(), messages);
+				};
+				auto startRequest = [self, sendRequest, pacing, requestedNumber]() {
+					RunWithRetry::start(sendRequest,
+						[self, pacing, requestedNumber]() {
+							bool retry;
+							{
+								ScopedLock lock(self->editBufferLock_);
+								retry = !self->hasEnded() && !self->handles_.empty() && self->downloadNumber_ == requestedNumber;
+							}
+							if (retry) {
+								pacing->requestTimedOut();
+								self->recordRetry();
+							}
+							return retry;
+						},
+						pacing->retries(),
+						pacing->timeoutMs(),
+						"requesting edit buffer");
+				};
+				int delay = pacing->delayBeforeNextRequestMs();
+				if (delay > 0) {
+					// Give a slow synth some room to breathe before the next request
+					Timer::callAfterDelay(delay, startRequest);
+				}
+				else {
+					startRequest();
+				}
+			}
+			else {
+				recordRequestSent();
+				sendToSynth(synth.get(), messages);
+			}
+		}
+	}
+
+	void DownloadSession::startDownloadNextPatch(std::shared_ptr<Synth> synth) {
+		ScopedLock lock(programDumpLock_);
+		// Get all commands
+		std::vector<MidiMessage> messages;
+		int requestedNumber = downloadNumber_;
+		auto programDumpCapability = caps_.programDump.get();
+		if (programDumpCapability) {
+			// Programs we have from an earlier attempt need not be requested again
+			skipCheckpointedPrograms();
+			if (downloadNumber_ >= endDownloadNumber_) {
+				return;
+			}
+			// Don't clear currentProgramDump_ here, with a request window > 1 the answer to a previous request might be arriving just now
+			requestedNumber = downloadNumber_;
+			messages = programDumpCapability->requestPatch(downloadNumber_);
+			downloadNumber_++;
+		}
+		else {
+			SimpleLogger::instance()->postMessage("Failure: This synth does not implement any valid capability to start downloading a full bank");
+			downloadNumber_ = endDownloadNumber_;
+		}
+
+		// Send messages
+		if (!messages.empty()) {
+			if (pacing_) {
+				// Send with the timeout learned for this synth, and request the program again if its answer got lost
+				auto pacing = pacing_;
+				auto self = shared_from_this();
+				auto stillMissing = [self, pacing, requestedNumber]() {
+					ScopedLock lock(self->programDumpLock_);
+					// A new pacing means the session has moved on to the next bank
+					return !self->hasEnded() && !self->handles_.empty() && self->pacing_ == pacing && self->receivedPrograms_.find(requestedNumber) == self->receivedPrograms_.end();
+				};
+				RunWithRetry::start([self, synth, messages, pacing, stillMissing]() {
+						if (!stillMissing()) {
+							// Canceled or already answered while we were waiting
+							return;
+						}
+						pacing->requestSent();
+						self->recordRequestSent();
+						self->sendToSynth(synth.get(), messages);
+					},
+					[self, pacing, stillMissing]() {
+						bool retry = stillMissing();
+						if (retry) {
+							pacing->requestTimedOut();
+							self->recordRetry();
+						}
+						return retry;
+					},
+					pacing->retries(),
+					pacing->timeoutMs(),
+					"requesting program dump");
+			}
+			else {
+				recordRequestSent();
+				sendToSynth(synth.get(), messages);
+			}
+		}
+	}
+
+	void DownloadSession::startDownloadNextDataItem(DataFileLoadCapability *sequencer, int dataFileIdentifier) {
+		std::vector<MidiMessage> request = sequencer->requestDataItem(downloadNumber_, dataFileIdentifier);
+		itemsInFlight_.emplace_back(downloadNumber_, Time::getMillisecondCounterHiRes());
+		downloadNumber_++;
+		recordRequestSent();
+		sendToSynth(dynamic_cast<Synth *>(sequencer), request);
+	}
+
+	void DownloadSession::handleNextStreamPart(const juce::MidiMessage &message, StreamLoadCapability::StreamType streamType)
+	{
+		auto const &synth = caps_.synth;
+		auto streamLoading = caps_.streamLoading.get();
+		if (streamLoading) {
+			if (streamLoading->isMessagePartOfStream(message, streamType)) {
+				recordMessageReceived(message);
+				currentDownload_.push_back(message);
+				int progressTotal = streamLoading->numberOfStreamMessagesExpected(streamType);
+				if (progressTotal > 0 && progressHandler_) {
+					progressHandler_->setProgressPercentage(currentDownload_.size() / (double)progressTotal);
+				}
+				if (streamLoading->isStreamComplete(currentDownload_, streamType)) {
+					clearHandlers();
+					parseInBackground(synth, std::move(currentDownload_), startDownloadNumber_, currentDownloadBank_);
+					currentDownload_.clear();
+					finishInBackground();
+				}
+				else if (progressHandler_ && progressHandler_->shouldAbort()) {
+					clearHandlers();
+					progressHandler_->onCancel();
+					endSession();
+				}
+				else if (streamLoading->shouldStreamAdvance(currentDownload_, streamType)) {
+					downloadNumber_++;
+					auto messages = streamLoading->requestStreamElement(downloadNumber_, streamType);
+					recordRequestSent();
+					sendToSynth(synth.get(), messages);
+					if (progressTotal == -1 && progressHandler_) progressHandler_->setProgressPercentage(downloadNumber_ / (double)expectedDownloadNumber_);
+				}
+			}
+		}
+		else {
+			jassertfalse;
+		}
+	}
+
+	void DownloadSession::handleNextEditBuffer(const juce::MidiMessage &editBuffer, MidiBankNumber bankNo) {
+		ScopedLock lock(editBufferLock_);
+		auto const &synth = caps_.synth;
+		auto editBufferCapability = caps_.editBuffer.get();
+		// This message might be a part of a multi-message program dump?
+		if (editBufferCapability) {
+			auto handshake = editBufferCapability->isMessagePartOfEditBuffer(editBuffer);
+			if (handshake.isPartOfEditBufferDump) {
+				// See if we should send a reply (ACK)
+				if (!handshake.handshakeReply.empty()) {
+					sendToSynth(synth.get(), handshake.handshakeReply);
+				}
+				recordMessageReceived(editBuffer);
+				currentEditBuffer_.push_back(editBuffer);
+				if (editBufferCapability->isEditBufferDump(currentEditBuffer_)) {
+					// Ok, that worked, parse it while we continue!
+					if (checkpoint_) checkpoint_->patchCompleted(downloadNumber_, currentEditBuffer_);
+					parseInBackground(synth, std::move(currentEditBuffer_), downloadNumber_, bankNo);
+					currentEditBuffer_.clear();
+					if (pacing_) pacing_->requestCompleted();
+					if (downloadNumber_ < endDownloadNumber_ - 1) {
+						downloadNumber_++;
+						skipCheckpointedPrograms();
+					}
+					else {
+						downloadNumber_ = endDownloadNumber_;
+					}
+
+					// Finished?
+					if (downloadNumber_ >= endDownloadNumber_) {
+						clearHandlers();
+						if (pacing_ && !replay_) pacing_->persist(); // The stand-in's timing says nothing about the real synth
+						finishInBackground();
+					}
+					else if (progressHandler_->shouldAbort()) {
+						clearHandlers();
+						progressHandler_->onCancel();
+						endSession();
+					}
+					else {
+						startDownloadNextEditBuffer(synth, true); // To continue with more than one download makes only sense if we send program change commands
+						if (progressHandler_) progressHandler_->setProgressPercentage((downloadNumber_ - startDownloadNumber_) / (double)(endDownloadNumber_ - startDownloadNumber_));
+					}
+				}
+			}
+		}
+		else {
+			// Ignore message
+		}
+	}
+
+	void DownloadSession::handleNextProgramBuffer(const juce::MidiMessage& editBuffer, MidiBankNumber bankNo) {
+		ScopedLock lock(programDumpLock_);
+		auto const &synth = caps_.synth;
+		auto programDumpCapability = caps_.programDump.get();
+		// This message might be a part of a multi-message program dump?
+		if (programDumpCapability) {
+			auto handshake = programDumpCapability->isMessagePartOfProgramDump(editBuffer);
+			if (handshake.isPartOfProgramDump) {
+				recordMessageReceived(editBuffer);
+				currentProgramDump_.push_back(editBuffer);
+				// See if we should send a reply (ACK)
+				if (!handshake.handshakeReply.empty()) {
+					sendToSynth(synth.get(), handshake.handshakeReply);
+				}
+				if (programDumpCapability->isSingleProgramDump(currentProgramDump_)) {
+					// Ok, that worked. With several requests in flight we can't assume this is the answer to the last request sent,
+					// so match it to its slot by the program number inside the dump
+					int slot = programDumpCapability->getProgramNumber(currentProgramDump_).toZeroBased();
+					bool validSlot = slot >= startDownloadNumber_ && slot < endDownloadNumber_;
+					if (validSlot && receivedPrograms_.find(slot) != receivedPrograms_.end()) {
+						// A second answer to a request sent again, we have this program already
+						currentProgramDump_.clear();
+						return;
+					}
+					if (!validSlot) {
+						// The synth doesn't report a usable number, so assume the answers arrive in the order requested
+						slot = startDownloadNumber_;
+						while (receivedPrograms_.find(slot) != receivedPrograms_.end()) {
+							slot++;
+						}
+					}
+					receivedPrograms_.insert(slot);
+					if (checkpoint_) checkpoint_->patchCompleted(slot, currentProgramDump_);
+					parseInBackground(synth, std::move(currentProgramDump_), slot, bankNo);
+					currentProgramDump_.clear();
+					if (pacing_) pacing_->requestCompleted();
+
+					// Finished?
+					int received = (int)receivedPrograms_.size();
+					if (received >= endDownloadNumber_ - startDownloadNumber_) {
+						clearHandlers();
+						receivedPrograms_.clear();
+						if (pacing_ && !replay_) pacing_->persist(); // The stand-in's timing says nothing about the real synth
+						finishInBackground();
+					}
+					else if (progressHandler_->shouldAbort()) {
+						clearHandlers();
+						progressHandler_->onCancel();
+						endSession();
+					}
+					else {
+						// Keep the window filled
+						if (downloadNumber_ < endDownloadNumber_) {
+							startDownloadNextPatch(synth);
+						}
+						if (progressHandler_) progressHandler_->setProgressPercentage(received / (double)(endDownloadNumber_ - startDownloadNumber_));
+					}
+				}
+			}
+		}
+	}
+
+	void DownloadSession::handleNextBankDump(const juce::MidiMessage &bankDump, MidiBankNumber bankNo)
+	{
+		auto const &synth = caps_.synth;
+		auto bankDumpCapability = caps_.bankDump.get();
+		if (bankDumpCapability && bankDumpCapability->isBankDump(bankDump)) {
+			if (currentDownload_.empty() && pacing_) {
+				// First answer to the bank request
+				pacing_->requestCompleted();
+			}
+			recordMessageReceived(bankDump);
+			currentDownload_.push_back(bankDump);
+			if (bankDumpCapability->isBankDumpFinished(currentDownload_)) {
+				clearHandlers();
+				if (pacing_ && !replay_) pacing_->persist(); // The stand-in's timing says nothing about the real synth
+				parseInBackground(synth, std::move(currentDownload_), startDownloadNumber_, bankNo);
+				currentDownload_.clear();
+				finishInBackground();
+			}
+			else if (progressHandler_->shouldAbort()) {
+				clearHandlers();
+				progressHandler_->onCancel();
+				endSession();
+			}
+			else {
+				progressHandler_->setProgressPercentage(currentDownload_.size() / (double)(expectedDownloadNumber_));
+			}
+		}
+	}
+
+	void DownloadSession::parseInBackground(std::shared_ptr<Synth> synth, std::vector<MidiMessage> messages, int slot, MidiBankNumber bankNo)
+	{
+		auto self = shared_from_this();
+		auto parse = [self, synth, messages = std::move(messages), slot, bankNo]() {
+			double parseStart = Time::getMillisecondCounterHiRes();
+			auto patches = synth->loadSysex(messages);
+			double tagStart = Time::getMillisecondCounterHiRes();
+			auto holders = self->tagPatchesWithImportFromSynth(synth, patches, bankNo, slot - self->startDownloadNumber_);
+			self->recordParsed((int)holders.size(), tagStart - parseStart, Time::getMillisecondCounterHiRes() - tagStart);
+			if (self->onPatchLoaded_) {
+				for (auto const &holder : holders) {
+					self->onPatchLoaded_(holder);
+				}
+			}
+			self->parsedPatches_[slot] = std::move(holders);
+		};
+		if (parser_) {
+			parser_->addJob(std::move(parse));
+		}
+		else {
+			parse();
+		}
+	}
+
+	void DownloadSession::finishInBackground()
+	{
+		// The parser runs its jobs in order, so when this job runs all patches of the bank have been parsed
+		auto self = shared_from_this();
+		auto checkpoint = checkpoint_;
+		auto finish = [self, checkpoint]() {
+			if (self->hasEnded()) {
+				// Aborted while the last patches were parsed, nobody wants them anymore
+				self->parsedPatches_.clear();
+				return;
+			}
+			std::vector<PatchHolder> result;
+			for (auto &parsed : self->parsedPatches_) {
+				std::move(parsed.second.begin(), parsed.second.end(), std::back_inserter(result));
+			}
+			self->parsedPatches_.clear();
+			if (checkpoint) {
+				// Complete, the next download of this bank starts from scratch
+				checkpoint->clear();
+			}
+			self->recordFinished(true);
+			self->onFinished_(std::move(result));
+			if (self->progressHandler_) self->progressHandler_->onSuccess();
+		};
+		if (parser_) {
+			parser_->addJob(finish);
+		}
+		else {
+			finish();
+		}
+	}
+
+	std::vector<PatchHolder> DownloadSession::tagPatchesWithImportFromSynth(std::shared_ptr<Synth> synth, TPatchVector &patches, MidiBankNumber bankNo, int firstPlace /* = 0 */) {
+		std::vector<PatchHolder> result;
+		auto sourceInfo = sourceInfoForBank(bankNo);
+		int i = firstPlace;
+		for (auto patch : patches) {
+			MidiProgramNumber place = MidiProgramNumber::fromZeroBase(i++);
+			auto realpatch = std::dynamic_pointer_cast<Patch>(patch);
+			if (realpatch) {
+				place = realpatch->patchNumber();
+			}
+			result.push_back(PatchHolder(synth, sourceInfo, patch, bankNo, place));
+		}
+		return result;
+	}
+
+	std::shared_ptr<SourceInfo> DownloadSession::sourceInfoForBank(MidiBankNumber bankNo)
+	{
+		// The SourceInfo is immutable, so all patches of a bank can share one instance instead of rendering the same JSON again and again
+		int key = bankNo.isValid() ? bankNo.toZeroBased() : -1;
+		auto found = sourceInfos_.find(key);
+		if (found != sourceInfos_.end()) {
+			return found->second;
+		}
+		std::shared_ptr<SourceInfo> sourceInfo = std::make_shared<FromSynthSource>(importTime_, bankNo);
+		if (isBulkImport_) {
+			// We have multiple import sources, so we need a BulkImport info. This replaces the per patch rewrite we did at the end of the download.
+			sourceInfo = std::make_shared<FromBulkImportSource>(bulkImportTime_, sourceInfo);
+		}
+		sourceInfos_[key] = sourceInfo;
+		return sourceInfo;
+	}
+
+}
@@ -0,0 +1,193 @@
+/*
+   Copyright (c) 2020 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#pragma once
+
+#include "JuceHeader.h"
+
+#include "MidiController.h"
+#include "Patch.h"
+#include "ProgressHandler.h"
+#include "MidiBankNumber.h"
+#include "PatchHolder.h"
+#include "DataFileLoadCapability.h"
+#include "StreamLoadCapability.h"
+#include "RequestPacing.h"
+#include "DownloadStatistics.h"
+#include "MidiTrafficLog.h"
+#include "MidiStandIn.h"
+#include "DownloadCheckpoint.h"
+#include "MidiWorker.h"
+#include "ThrottledProgress.h"
+
+#include <stack>
+#include <map>
+#include <set>
+#include <atomic>
+#include <deque>
+
+namespace midikraft {
+
+	class Synth;
+	class HandshakeLoadingCapability;
+	class BankDumpCapability;
+	class EditBufferCapability;
+	class ProgramDumpCabability;
+	class MidiLocationCapability;
+	class SendsProgramChangeCapability;
+
+	// Receives the patches of a download bank by bank, so the caller can store them away while the next bank is still downloading.
+	// Ownership of the patches is passed on to the sink.
+	class DownloadSink {
+	public:
+		virtual ~DownloadSink() = default;
+		virtual void bankDownloaded(MidiBankNumber bankNo, std::vector<PatchHolder> &&patches) = 0;
+		virtual void downloadFinished(bool completed) = 0;
+	};
+
+	// The capabilities of the synth we download from, looked up once when the download starts instead of for every message received
+	struct DownloadCapabilities {
+		DownloadCapabilities() = default;
+		explicit DownloadCapabilities(std::shared_ptr<Synth> synth);
+
+		std::shared_ptr<Synth> synth;
+		std::shared_ptr<StreamLoadCapability> streamLoading;
+		std::shared_ptr<HandshakeLoadingCapability> handshakeLoading;
+		std::shared_ptr<BankDumpCapability> bankDump;
+		std::shared_ptr<EditBufferCapability> editBuffer;
+		std::shared_ptr<ProgramDumpCabability> programDump;
+		std::shared_ptr<MidiLocationCapability> midiLocation;
+		std::shared_ptr<SendsProgramChangeCapability> programChange;
+	};
+
+	// A DownloadSession owns everything needed for one download operation from one synth - the MIDI handlers, the buffers
+	// collecting the messages, and the counters. Several sessions can run at the same time on different MIDI outputs,
+	// the Librarian decides when to start them.
+	class DownloadSession : public std::enable_shared_from_this<DownloadSession> {
+	public:
+		typedef std::function<void(std::vector<PatchHolder>)> TFinishedHandler;
+		typedef std::function<void(std::vector<std::shared_ptr<DataFile>>)> TStepSequencerFinishedHandler;
+		typedef std::function<void(PatchHolder)> TPatchLoadedHandler;
+		typedef std::function<void(DownloadSession *)> TSessionEndedHandler;
+
+		// Patches are parsed on the parser thread pool as they arrive, if none is given they are parsed on the MIDI thread
+		DownloadSession(std::shared_ptr<SafeMidiOutput> midiOutput, ProgressHandler *progressHandler, TSessionEndedHandler onSessionEnded, ThreadPool *parser = nullptr);
+		virtual ~DownloadSession();
+
+		void startDownloadingAllPatches(std::shared_ptr<Synth> synth, std::vector<MidiBankNumber> bankNo, std::shared_ptr<DownloadSink> sink, TPatchLoadedHandler onPatchLoaded = nullptr);
+		void startDownloadingAllPatches(std::shared_ptr<Synth> synth, std::vector<MidiBankNumber> bankNo, TFinishedHandler onFinished, TPatchLoadedHandler onPatchLoaded = nullptr);
+		// Only the given programs of the bank, if the synth does program or edit buffer dumps. Other synths deliver the full bank
+		void startDownloadingPrograms(std::shared_ptr<Synth> synth, MidiBankNumber bankNo, std::set<int> const &programs, std::shared_ptr<DownloadSink> sink);
+		void downloadEditBuffer(std::shared_ptr<Synth> synth, TFinishedHandler onFinished);
+		// Keeps windowSize requests in flight
+		void startDownloadingSequencerData(DataFileLoadCapability *sequencer, int dataFileIdentifier, int windowSize, TStepSequencerFinishedHandler onFinished);
+
+		// Stops listening to MIDI and ends the session without calling the finished handler
+		void abort();
+		bool hasEnded() const;
+
+		std::string outputIdentifier() const;
+
+		// Snapshot of the timing and throughput of this session so far
+		DownloadStatistics statistics() const;
+
+		// Call before starting the download. Runs the MIDI handlers on the worker's thread instead of the MIDI input thread
+		void runHandlersOn(std::shared_ptr<MidiWorker> worker);
+		// Call before starting the download. Records all MIDI traffic of the session into the log,
+		// or takes the answers from a replay or an emulated synth instead of the real synth.
+		void recordTo(std::shared_ptr<MidiTrafficLog> trafficLog);
+		void replayFrom(std::shared_ptr<MidiStandIn> replay);
+		// Keep the completed patches of edit buffer and program dump downloads here, and skip those already there
+		void resumeWith(std::shared_ptr<DownloadCheckpoints> checkpoints);
+
+	private:
+		void startDownloadingBank(std::shared_ptr<Synth> synth, MidiBankNumber bankNo, TFinishedHandler onFinished);
+		void startDownloadNextEditBuffer(std::shared_ptr<Synth> synth, bool sendProgramChange);
+		void startDownloadNextPatch(std::shared_ptr<Synth> synth);
+		void startDownloadNextDataItem(DataFileLoadCapability *sequencer, int dataFileIdentifier);
+		void resolveCapabilities(std::shared_ptr<Synth> synth);
+		// These run on the MIDI thread for every message received, they use the capabilities resolved when the download started
+		void handleNextStreamPart(const juce::MidiMessage &message, StreamLoadCapability::StreamType streamType);
+		void handleNextEditBuffer(const juce::MidiMessage &editBuffer, MidiBankNumber bankNo);
+		void handleNextProgramBuffer(const juce::MidiMessage& editBuffer, MidiBankNumber bankNo);
+		void handleNextBankDump(const juce::MidiMessage& bankDump, MidiBankNumber bankNo);
+
+		// Takes the messages over, the caller's buffer is free for the next patch right away
+		void parseInBackground(std::shared_ptr<Synth> synth, std::vector<MidiMessage> messages, int slot, MidiBankNumber bankNo);
+		void finishInBackground();
+
+		std::vector<PatchHolder> tagPatchesWithImportFromSynth(std::shared_ptr<Synth> synth, TPatchVector &patches, MidiBankNumber bankNo, int firstPlace = 0);
+		std::shared_ptr<SourceInfo> sourceInfoForBank(MidiBankNumber bankNo);
+
+		void resumeFromCheckpoint(std::shared_ptr<Synth> synth, MidiBankNumber bankNo);
+		void skipCheckpointedPrograms();
+
+		void startStatistics(std::string const &synthName, std::string const &mode);
+		void recordRequestSent();
+		void recordRetry();
+		void recordMessageReceived(MidiMessage const &message);
+		void recordParsed(int patches, double parseMs, double tagMs);
+		void recordRoundTrip(double roundTripMs);
+		void recordFinished(bool completed);
+		void logStatistics() const;
+
+		void addHandler(MidiController::HandlerHandle const &handle, std::function<void(MidiInput *, MidiMessage const &)> handler);
+		void sendToSynth(Synth *synth, std::vector<MidiMessage> const &messages);
+		void clearHandlers();
+		void endSession();
+
+		std::shared_ptr<SafeMidiOutput> midiOutput_;
+		ProgressHandler *progressHandler_;
+		std::unique_ptr<ThrottledProgress> throttledProgress_; // Wraps the progress handler given to us
+		TSessionEndedHandler onSessionEnded_;
+		std::atomic<bool> ended_;
+
+		std::vector<MidiMessage> currentDownload_;
+		std::vector<MidiMessage> currentEditBuffer_; // Guarded by editBufferLock_, like downloadNumber_ in edit buffer downloads
+		CriticalSection editBufferLock_; // The edit buffer request retries run on the message thread
+		std::vector<MidiMessage> currentProgramDump_; // Guarded by programDumpLock_, like downloadNumber_ and receivedPrograms_ in program dump downloads
+		CriticalSection programDumpLock_; // The program dump request retries run on the message thread
+		std::set<int> receivedPrograms_; // Program slots received completely, or restored from the checkpoint
+		std::set<int> onlyPrograms_; // If not empty, the program slots to download
+		std::map<int, MidiMessage> sequencerItems_; // Data items received, by index
+		std::deque<std::pair<int, double>> itemsInFlight_; // Data items requested, with the time of the request
+		std::map<int, std::vector<PatchHolder>> parsedPatches_; // By program slot, only touched on the parser thread
+		MidiBankNumber currentDownloadBank_;
+		std::stack<MidiController::HandlerHandle> handles_;
+		TFinishedHandler onFinished_;
+		TStepSequencerFinishedHandler onSequencerFinished_;
+		TPatchLoadedHandler onPatchLoaded_;
+		ThreadPool *parser_;
+		Time importTime_; // One timestamp for all patches of a bank
+		int downloadNumber_;
+		int startDownloadNumber_;
+		int endDownloadNumber_;
+		int expectedDownloadNumber_;
+		std::shared_ptr<RequestPacing> pacing_; // Round trip measurement of the current download
+
+		// To download multiple banks in one session
+		TFinishedHandler nextBankHandler_;
+		std::shared_ptr<DownloadSink> sink_; // Guarded by sinkLock_, the parser thread hands out the banks and an abort ends the download
+		CriticalSection sinkLock_;
+		int downloadBankNumber_;
+		bool isBulkImport_;
+		Time bulkImportTime_;
+		std::map<int, std::shared_ptr<SourceInfo>> sourceInfos_; // Shared by all patches of a bank, only touched on the parser thread
+
+		DownloadCapabilities caps_; // Written before the MIDI handlers are registered, then only read
+		String inputIdentifier_; // The synth's MIDI input, MidiController calls our handlers for the messages of all inputs
+		std::shared_ptr<MidiWorker> worker_; // Shared, the session might outlive the Librarian
+		std::vector<std::shared_ptr<MidiWorker::Inbox>> inboxes_;
+		std::shared_ptr<MidiTrafficLog> trafficLog_;
+		std::shared_ptr<MidiStandIn> replay_;
+		std::shared_ptr<DownloadCheckpoints> checkpoints_;
+		std::shared_ptr<DownloadCheckpoint> checkpoint_; // Of the bank currently downloading
+
+		CriticalSection statsLock_;
+		DownloadStatistics stats_;
+	};
+
+}
@@ -0,0 +1,74 @@
+/*
+   Copyright (c) 2020 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#include "DownloadStatistics.h"
+
+// Turn off warning on unknown pragmas for VC++
+#pragma warning(push)
+#pragma warning(disable: 4068)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wswitch-enum"
+#include "nlohmann/json.hpp"
+#pragma GCC diagnostic pop
+#pragma warning(pop)
+
+namespace midikraft {
+
+	double DownloadStatistics::durationMs() const
+	{
+		if (started == 0.0) {
+			return 0.0;
+		}
+		double end = finished != 0.0 ? finished : Time::getMillisecondCounterHiRes();
+		return end - started;
+	}
+
+	double DownloadStatistics::patchesPerSecond() const
+	{
+		double duration = durationMs();
+		return duration > 0.0 ? patches * 1000.0 / duration : 0.0;
+	}
+
+	double DownloadStatistics::bytesPerSecond() const
+	{
+		double duration = durationMs();
+		return duration > 0.0 ? bytesReceived * 1000.0 / duration : 0.0;
+	}
+
+	double DownloadStatistics::averageRoundTripMs() const
+	{
+		return roundTrips > 0 ? roundTripMs / roundTrips : 0.0;
+	}
+
+	std::string DownloadStatistics::toJson() const
+	{
+		auto relative = [this](double timestamp) {
+			return timestamp != 0.0 ? timestamp - started : -1.0;
+		};
+		nlohmann::json stats = {
+			{ "synth", synthName },
+			{ "mode", mode },
+			{ "completed", completed },
+			{ "duration_ms", durationMs() },
+			{ "first_request_ms", relative(firstRequestSent) },
+			{ "first_response_ms", relative(firstResponse) },
+			{ "last_message_ms", relative(lastMessageReceived) },
+			{ "finished_ms", relative(finished) },
+			{ "parse_ms", parseMs },
+			{ "tag_ms", tagMs },
+			{ "avg_round_trip_ms", averageRoundTripMs() },
+			{ "bytes", bytesReceived },
+			{ "messages", messagesReceived },
+			{ "requests", requestsSent },
+			{ "retries", retries },
+			{ "patches", patches },
+			{ "patches_per_second", patchesPerSecond() },
+			{ "bytes_per_second", bytesPerSecond() }
+		};
+		return stats.dump();
+	}
+
+}
@@ -0,0 +1,45 @@
+/*
+   Copyright (c) 2020 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#pragma once
+
+#include "JuceHeader.h"
+
+namespace midikraft {
+
+	// Where does the time go in a download? All timestamps are in milliseconds of Time::getMillisecondCounterHiRes(), 0 means it didn't happen (yet).
+	struct DownloadStatistics {
+		std::string synthName;
+		std::string mode;
+
+		double started = 0.0;
+		double firstRequestSent = 0.0;
+		double firstResponse = 0.0;
+		double lastMessageReceived = 0.0;
+		double finished = 0.0;
+
+		double parseMs = 0.0; // Time spent in Synth::loadSysex
+		double tagMs = 0.0; // Time spent creating the PatchHolders
+		double roundTripMs = 0.0; // Sum over all requests where we could match the answer
+		int roundTrips = 0;
+
+		int64 bytesReceived = 0;
+		int messagesReceived = 0;
+		int requestsSent = 0;
+		int retries = 0;
+		int patches = 0;
+		bool completed = false;
+
+		double durationMs() const;
+		double patchesPerSecond() const;
+		double bytesPerSecond() const;
+		double averageRoundTripMs() const;
+
+		// One JSON object, with all timestamps relative to the start of the download
+		std::string toJson() const;
+	};
+
+}
@@ -0,0 +1,38 @@
+/*
+   Copyright (c) 2020 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#include "DumpFormats.h"
+
+#include "Synth.h"
+#include "ProgramDumpCapability.h"
+#include "EditBufferCapability.h"
+#include "BankDumpCapability.h"
+
+namespace midikraft {
+
+	DumpFormats::DumpFormats(std::shared_ptr<Synth> synth)
+	{
+		programDump = midikraft::Capability::hasCapability<ProgramDumpCabability>(synth);
+		editBuffer = midikraft::Capability::hasCapability<EditBufferCapability>(synth);
+		bankDump = midikraft::Capability::hasCapability<BankDumpCapability>(synth);
+	}
+
+	bool DumpFormats::knowsDumpEnd() const
+	{
+		return programDump || editBuffer || bankDump;
+	}
+
+	bool DumpFormats::isCompleteDump(std::vector<MidiMessage> const &messages) const
+	{
+		if (messages.empty()) {
+			return false;
+		}
+		return (programDump && programDump->isSingleProgramDump(messages))
+			|| (editBuffer && editBuffer->isEditBufferDump(messages))
+			|| (bankDump && bankDump->isBankDump(messages.front()) && bankDump->isBankDumpFinished(messages));
+	}
+
+}
@@ -0,0 +1,31 @@
+/*
+   Copyright (c) 2020 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#pragma once
+
+#include "JuceHeader.h"
+
+namespace midikraft {
+
+	class Synth;
+	class ProgramDumpCabability;
+	class EditBufferCapability;
+	class BankDumpCapability;
+
+	// The dump formats of a synth, looked up once, to tell where one dump in a stream of messages ends
+	struct DumpFormats {
+		explicit DumpFormats(std::shared_ptr<Synth> synth);
+
+		// True if the synth has any format we can find the end of
+		bool knowsDumpEnd() const;
+		bool isCompleteDump(std::vector<MidiMessage> const &messages) const;
+
+		std::shared_ptr<ProgramDumpCabability> programDump;
+		std::shared_ptr<EditBufferCapability> editBuffer;
+		std::shared_ptr<BankDumpCapability> bankDump;
+	};
+
+}
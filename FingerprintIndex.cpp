@@ -0,0 +1,177 @@
+/*
+   Copyright (c) 2020 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#include "FingerprintIndex.h"
+
+#include "Synth.h"
+#include "Logger.h"
+
+#include "fmt/format.h"
+
+#include <algorithm>
+
+namespace midikraft {
+
+	// About 1% false positives with 4 hash functions
+	const size_t kFilterBitsPerEntry = 10;
+	const int kFilterHashes = 4;
+	const size_t kMinimumFilterEntries = 1 << 16;
+
+	FingerprintIndex::FingerprintIndex(File const &indexFile) : file_(indexFile), filterCapacity_(0)
+	{
+		openFile();
+		rebuildFilter(numFileEntries());
+	}
+
+	bool FingerprintIndex::contains(std::string const &synthName, std::string const &fingerprint) const
+	{
+		uint64 hash = hashOf(synthName, fingerprint);
+		ScopedLock lock(lock_);
+		if (!filterMightContain(hash)) {
+			return false;
+		}
+		return added_.find(hash) != added_.end() || fileContains(hash);
+	}
+
+	void FingerprintIndex::add(std::string const &synthName, std::string const &fingerprint)
+	{
+		uint64 hash = hashOf(synthName, fingerprint);
+		ScopedLock lock(lock_);
+		if (fileContains(hash)) {
+			return;
+		}
+		added_.insert(hash);
+		if (numFileEntries() + added_.size() > filterCapacity_) {
+			// Keep the false positive rate down as the index grows
+			rebuildFilter(2 * filterCapacity_);
+		}
+		else {
+			addToFilter(hash);
+		}
+	}
+
+	void FingerprintIndex::add(std::vector<PatchHolder> const &patches)
+	{
+		for (auto const &patch : patches) {
+			if (patch.synth() && patch.patch()) {
+				add(patch.synth()->getName(), patch.md5());
+			}
+		}
+	}
+
+	bool FingerprintIndex::save()
+	{
+		ScopedLock lock(lock_);
+		if (added_.empty()) {
+			return true;
+		}
+		std::vector<uint64> merged;
+		merged.reserve(numFileEntries() + added_.size());
+		std::merge(fileEntries(), fileEntries() + numFileEntries(), added_.begin(), added_.end(), std::back_inserter(merged));
+		// The mapping has to go before the file can be replaced
+		mapped_.reset();
+		bool ok = file_.replaceWithData(merged.data(), merged.size() * sizeof(uint64));
+		if (ok) {
+			added_.clear();
+		}
+		else {
+			SimpleLogger::instance()->postMessage(fmt::format("Failed to write fingerprint index {}", file_.getFullPathName().toStdString()));
+		}
+		openFile();
+		return ok;
+	}
+
+	size_t FingerprintIndex::size() const
+	{
+		ScopedLock lock(lock_);
+		return numFileEntries() + added_.size();
+	}
+
+	uint64 FingerprintIndex::hashOf(std::string const &synthName, std::string const &fingerprint)
+	{
+		// FNV-1a over synth name and fingerprint
+		uint64 hash = 14695981039346656037ULL;
+		auto mix = [&hash](std::string const &text) {
+			for (char c : text) {
+				hash ^= (uint8)c;
+				hash *= 1099511628211ULL;
+			}
+		};
+		mix(synthName);
+		mix(std::string(1, '\0'));
+		mix(fingerprint);
+		return hash;
+	}
+
+	void FingerprintIndex::openFile()
+	{
+		mapped_.reset();
+		if (file_.existsAsFile() && file_.getSize() >= (int64)sizeof(uint64)) {
+			mapped_ = std::make_unique<MemoryMappedFile>(file_, MemoryMappedFile::readOnly);
+			if (mapped_->getData() == nullptr) {
+				SimpleLogger::instance()->postMessage(fmt::format("Failed to open fingerprint index {}, known patches will be imported again", file_.getFullPathName().toStdString()));
+				mapped_.reset();
+			}
+		}
+	}
+
+	void FingerprintIndex::rebuildFilter(size_t expectedEntries)
+	{
+		filterCapacity_ = std::max(kMinimumFilterEntries, expectedEntries);
+		size_t words = 1;
+		while (words * 64 < filterCapacity_ * kFilterBitsPerEntry) {
+			words <<= 1;
+		}
+		filter_.assign(words, 0);
+		for (size_t i = 0; i < numFileEntries(); i++) {
+			addToFilter(fileEntries()[i]);
+		}
+		for (auto hash : added_) {
+			addToFilter(hash);
+		}
+	}
+
+	void FingerprintIndex::addToFilter(uint64 hash)
+	{
+		uint64 mask = filter_.size() * 64 - 1;
+		uint64 h1 = hash & 0xffffffff;
+		uint64 h2 = (hash >> 32) | 1;
+		for (int i = 0; i < kFilterHashes; i++) {
+			uint64 bit = (h1 + i * h2) & mask;
+			filter_[bit >> 6] |= 1ULL << (bit & 63);
+		}
+	}
+
+	bool FingerprintIndex::filterMightContain(uint64 hash) const
+	{
+		uint64 mask = filter_.size() * 64 - 1;
+		uint64 h1 = hash & 0xffffffff;
+		uint64 h2 = (hash >> 32) | 1;
+		for (int i = 0; i < kFilterHashes; i++) {
+			uint64 bit = (h1 + i * h2) & mask;
+			if ((filter_[bit >> 6] & (1ULL << (bit & 63))) == 0) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	bool FingerprintIndex::fileContains(uint64 hash) const
+	{
+		return std::binary_search(fileEntries(), fileEntries() + numFileEntries(), hash);
+	}
+
+	uint64 const *FingerprintIndex::fileEntries() const
+	{
+		return mapped_ ? static_cast<uint64 const *>(mapped_->getData()) : nullptr;
+	}
+
+	size_t FingerprintIndex::numFileEntries() const
+	{
+		return mapped_ ? mapped_->getSize() / sizeof(uint64) : 0;
+	}
+
+}
@@ -0,0 +1,52 @@
+/*
+   Copyright (c) 2020 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#pragma once
+
+#include "JuceHeader.h"
+
+#include "PatchHolder.h"
+
+#include <set>
+
+namespace midikraft {
+
+	// The fingerprints of the patches already in the database, so an import can skip them right after hashing.
+	// On disk this is a sorted array of 64 bit hashes of synth name and fingerprint, which is mapped into memory and binary searched.
+	// A bloom filter in front of it answers most questions about new patches without touching the file.
+	// The index doesn't know what the database stores, whoever stores patches needs to add them here.
+	class FingerprintIndex {
+	public:
+		explicit FingerprintIndex(File const &indexFile);
+
+		bool contains(std::string const &synthName, std::string const &fingerprint) const;
+		void add(std::string const &synthName, std::string const &fingerprint);
+		void add(std::vector<PatchHolder> const &patches);
+
+		// Writes the fingerprints added since the last save into the file
+		bool save();
+
+		size_t size() const;
+
+	private:
+		static uint64 hashOf(std::string const &synthName, std::string const &fingerprint);
+		void openFile();
+		void rebuildFilter(size_t expectedEntries);
+		void addToFilter(uint64 hash);
+		bool filterMightContain(uint64 hash) const;
+		bool fileContains(uint64 hash) const;
+		uint64 const *fileEntries() const;
+		size_t numFileEntries() const;
+
+		File file_;
+		mutable CriticalSection lock_;
+		std::unique_ptr<MemoryMappedFile> mapped_;
+		std::set<uint64> added_; // Not yet in the file
+		std::vector<uint64> filter_;
+		size_t filterCapacity_; // Entries the filter was sized for
+	};
+
+}
@@ -18,6 +18,8 @@
 #include "LegacyLoaderCapability.h"
 #include "SendsProgramChangeCapability.h"
 #include "PatchInterchangeFormat.h"
+#include "MappedPatchFile.h"
+#include "DumpFormats.h"
 
 #include "RunWithRetry.h"
 #include "MidiHelpers.h"
@@ -30,249 +32,157 @@
 namespace midikraft {
 
 
-	void Librarian::startDownloadingAllPatches(std::shared_ptr<SafeMidiOutput> midiOutput, std::shared_ptr<Synth> synth, std::vector<MidiBankNumber> bankNo,
-		ProgressHandler *progressHandler, TFinishedHandler onFinished) {
-
-		downloadBankNumber_ = 0;
-		if (!bankNo.empty()) {
-			currentDownloadedPatches_.clear();
-			nextBankHandler_ = [this, midiOutput, synth, progressHandler, bankNo, onFinished](std::vector<midikraft::PatchHolder> patchesLoaded) {
-				std::copy(patchesLoaded.begin(), patchesLoaded.end(), std::back_inserter(currentDownloadedPatches_));
-				downloadBankNumber_++;
-				if (downloadBankNumber_ == bankNo.size()) {
-					if (bankNo.size() > 1) {
-						tagPatchesWithMultiBulkImport(currentDownloadedPatches_);
-					}
-					onFinished(currentDownloadedPatches_);
-				}
-				else {
-					if (!progressHandler->shouldAbort()) {
-						progressHandler->setMessage(fmt::format("Importing {} from {}...", SynthBank::friendlyBankName(synth, bankNo[downloadBankNumber_]), synth->getName()));
-						startDownloadingAllPatches(midiOutput, synth, bankNo[downloadBankNumber_], progressHandler, nextBankHandler_);
-					}
-				}
-			};
-			progressHandler->setMessage(fmt::format("Importing {} from {}...", SynthBank::friendlyBankName(synth, bankNo[0]), synth->getName()));
-			startDownloadingAllPatches(midiOutput, synth, bankNo[0], progressHandler, nextBankHandler_);
+	Librarian::~Librarian()
+	{
+		{
+			// From now on the callbacks of sessions and uploads still around leave us alone
+			ScopedLock lock(lifetime_->lock);
+			lifetime_->alive = false;
 		}
+		// A session kept alive by a pending retry must not hand anything to our parser anymore
+		clearHandlers();
+	}
+
+	void Librarian::startDownloadingAllPatches(std::shared_ptr<SafeMidiOutput> midiOutput, std::shared_ptr<Synth> synth, std::vector<MidiBankNumber> bankNo,
+		ProgressHandler *progressHandler, TFinishedHandler onFinished, TPatchLoadedHandler onPatchLoaded /* = nullptr */) {
+		auto session = std::make_shared<DownloadSession>(midiOutput, progressHandler, sessionEndedHandler(), parser_.get());
+		scheduleSession(session, synth->getName(), [session, synth, bankNo, onFinished, onPatchLoaded]() {
+			session->startDownloadingAllPatches(synth, bankNo, onFinished, onPatchLoaded);
+		});
+	}
+
+	void Librarian::startDownloadingAllPatches(std::shared_ptr<SafeMidiOutput> midiOutput, std::shared_ptr<Synth> synth, std::vector<MidiBankNumber> bankNo,
+		ProgressHandler *progressHandler, std::shared_ptr<DownloadSink> sink, TPatchLoadedHandler onPatchLoaded /* = nullptr */) {
+		auto session = std::make_shared<DownloadSession>(midiOutput, progressHandler, sessionEndedHandler(), parser_.get());
+		scheduleSession(session, synth->getName(), [session, synth, bankNo, sink, onPatchLoaded]() {
+			session->startDownloadingAllPatches(synth, bankNo, sink, onPatchLoaded);
+		});
 	}
 
 	void Librarian::startDownloadingAllPatches(std::shared_ptr<SafeMidiOutput> midiOutput, std::shared_ptr<Synth> synth, MidiBankNumber bankNo,
-		ProgressHandler *progressHandler, TFinishedHandler onFinished)
+		ProgressHandler *progressHandler, TFinishedHandler onFinished, TPatchLoadedHandler onPatchLoaded /* = nullptr */)
 	{
-		// First things first - this should not be called more than once at a time, and there should be no other Librarian callback handlers be registered!
-		jassert(handles_.empty());
-		clearHandlers();
+		startDownloadingAllPatches(midiOutput, synth, std::vector<MidiBankNumber>({ bankNo }), progressHandler, onFinished, onPatchLoaded);
+	}
 
-		// Ok, for this we need to send a program change message, and then a request edit buffer message from the active synth
-		// Once we get that, store the patch and increment number by one
-		downloadNumber_ = 0;
-		currentDownload_.clear();
-		onFinished_ = onFinished;
-
-		// Determine what we will do with the answer...
-		auto handle = MidiController::makeOneHandle();
-		auto streamLoading = midikraft::Capability::hasCapability<StreamLoadCapability>(synth);
-		auto bankCapableSynth = midikraft::Capability::hasCapability<BankDumpCapability>(synth);
-		auto handshakeLoadingRequired = midikraft::Capability::hasCapability<HandshakeLoadingCapability>(synth);
-		if (streamLoading) {
-			// Simple enough, we hope
-			MidiController::instance()->addMessageHandler(handle, [this, synth, progressHandler, midiOutput](MidiInput *source, const juce::MidiMessage &editBuffer) {
-				ignoreUnused(source);
-				this->handleNextStreamPart(midiOutput, synth, progressHandler, editBuffer, StreamLoadCapability::StreamType::BANK_DUMP);
-			});
-			handles_.push(handle);
-			currentDownloadBank_ = bankNo;
-			expectedDownloadNumber_ = SynthBank::numberOfPatchesInBank(synth, bankNo);
-			if (expectedDownloadNumber_ > 0) {
-				auto messages = streamLoading->requestStreamElement(bankNo.toZeroBased(), StreamLoadCapability::StreamType::BANK_DUMP);
-				synth->sendBlockOfMessagesToSynth(midiOutput->deviceInfo(), messages);
-			}
-		}
-		else if (handshakeLoadingRequired) {
-			// These are proper protocols that are implemented - each message we get from the synth has to be answered by an appropriate next message
-			std::shared_ptr<HandshakeLoadingCapability::ProtocolState>  state = handshakeLoadingRequired->createStateObject();
-			if (state) {
-				MidiController::instance()->addMessageHandler(handle, [this, handshakeLoadingRequired, state, progressHandler, midiOutput, synth, bankNo](MidiInput *source, const juce::MidiMessage &protocolMessage) {
-					ignoreUnused(source);
-					std::vector<MidiMessage> answer;
-					if (handshakeLoadingRequired->isNextMessage(protocolMessage, answer, state)) {
-						// Store message
-						currentDownload_.push_back(protocolMessage);
-					}
-					// Send an answer if the handshake handler constructed one
-					if (!answer.empty()) {
-						synth->sendBlockOfMessagesToSynth(midiOutput->deviceInfo(), answer);
-					}
-					// Update progress handler
-					progressHandler->setProgressPercentage(state->progress());
-
-					// Stop handler when finished
-					if (state->isFinished() || progressHandler->shouldAbort()) {
-						clearHandlers();
-						if (state->wasSuccessful()) {
-							// Parse patches and send them back 
-							auto patches = synth->loadSysex(currentDownload_);
-							onFinished_(tagPatchesWithImportFromSynth(synth, patches, bankNo));							
-							progressHandler->onSuccess();
-						}
-						else {
-							progressHandler->onCancel();
-						}
-					}
-				});
-				handles_.push(handle);
-				handshakeLoadingRequired->startDownload(midiOutput, state);
+	void Librarian::downloadEditBuffer(std::shared_ptr<SafeMidiOutput> midiOutput, std::shared_ptr<Synth> synth, ProgressHandler *progressHandler, TFinishedHandler onFinished)
+	{
+		auto session = std::make_shared<DownloadSession>(midiOutput, progressHandler, sessionEndedHandler(), parser_.get());
+		scheduleSession(session, synth->getName(), [session, synth, onFinished]() {
+			session->downloadEditBuffer(synth, onFinished);
+		});
+	}
+
+	void Librarian::startDownloadingSequencerData(std::shared_ptr<SafeMidiOutput> midiOutput, DataFileLoadCapability *sequencer, int dataFileIdentifier, ProgressHandler *progressHandler, TStepSequencerFinishedHandler onFinished)
+	{
+		auto session = std::make_shared<DownloadSession>(midiOutput, progressHandler, sessionEndedHandler());
+		int windowSize = sequencerWindowSize(sequencer);
+		auto device = dynamic_cast<NamedDeviceCapability *>(sequencer);
+		scheduleSession(session, device ? device->getName() : "", [session, sequencer, dataFileIdentifier, windowSize, onFinished]() {
+			session->startDownloadingSequencerData(sequencer, dataFileIdentifier, windowSize, onFinished);
+		});
+	}
+
+	void Librarian::scheduleSession(std::shared_ptr<DownloadSession> session, std::string const &deviceName, std::function<void()> start)
+	{
+		bool outputBusy = false;
+		{
+			ScopedLock lock(sessionLock_);
+			session->resumeWith(checkpoints_);
+			session->runHandlersOn(midiWorker_);
+			if (trafficLog_) {
+				session->recordTo(trafficLog_);
 			}
-			else {
-				jassert(false);
-			}
-		}
-		else if (bankCapableSynth) {
-			// This is a mixture - you send one message (bank request), and then you get either one message back (like Kawai K3) or a stream of messages with
-			// one message per patch (e.g. Access Virus or Matrix1000)
-			auto buffer = bankCapableSynth->requestBankDump(bankNo);
-			auto outname = midiOutput->deviceInfo();
-			RunWithRetry::start([this, synth, outname, buffer, bankNo]() {
-					expectedDownloadNumber_ = SynthBank::numberOfPatchesInBank(synth, bankNo);
-					synth->sendBlockOfMessagesToSynth(outname, buffer);
-					}, 
-				[this]() {
-					return currentDownload_.empty();
-				},
-				3,
-				500,
-				"initiating bank dump");
-
-			MidiController::instance()->addMessageHandler(handle, [this, synth, progressHandler, midiOutput, bankNo](MidiInput *source, const juce::MidiMessage &editBuffer) {
-				ignoreUnused(source);
-				this->handleNextBankDump(midiOutput, synth, progressHandler, editBuffer, bankNo);
-			});
-			handles_.push(handle);
-			currentDownload_.clear();
-		}
-		else {
-			// Uh, stone age, need to start a loop
-			auto editBufferCapability = midikraft::Capability::hasCapability<EditBufferCapability>(synth);
-			auto programDumpCapability = midikraft::Capability::hasCapability<ProgramDumpCabability>(synth);
-			if (programDumpCapability) {
-				MidiController::instance()->addMessageHandler(handle, [this, synth, progressHandler, midiOutput, bankNo](MidiInput* source, const juce::MidiMessage& editBuffer) {
-					ignoreUnused(source);
-					this->handleNextProgramBuffer(midiOutput, synth, progressHandler, editBuffer, bankNo);
-				});
-				handles_.push(handle);
-				downloadNumber_ = SynthBank::startIndexInBank(synth, bankNo);
-				startDownloadNumber_ = downloadNumber_;
-				endDownloadNumber_ = downloadNumber_ + SynthBank::numberOfPatchesInBank(synth, bankNo);
-				startDownloadNextPatch(midiOutput, synth);
-			}
-			else if (editBufferCapability) {
-				MidiController::instance()->addMessageHandler(handle, [this, synth, progressHandler, midiOutput, bankNo](MidiInput* source, const juce::MidiMessage& editBuffer) {
-					ignoreUnused(source);
-					this->handleNextEditBuffer(midiOutput, synth, progressHandler, editBuffer, bankNo);
-				});
-				handles_.push(handle);
-				downloadNumber_ = SynthBank::startIndexInBank(synth, bankNo);
-				startDownloadNumber_ = downloadNumber_;
-				endDownloadNumber_ = downloadNumber_ + SynthBank::numberOfPatchesInBank(synth, bankNo);
-				startDownloadNextEditBuffer(midiOutput, synth, true);
+			if (trafficReplay_ && !deviceName.empty() && trafficReplay_->deviceName() == deviceName) {
+				// The replay plays the synth, nothing goes to its MIDI output
+				session->replayFrom(trafficReplay_);
 			}
-			else {
-				SimpleLogger::instance()->postMessage("Error: This synth has not implemented a single method to retrieve a bank. Please consult the documentation!");
+			else if (virtualSynth_ && !deviceName.empty() && virtualSynth_->deviceName() == deviceName) {
+				session->replayFrom(virtualSynth_);
 			}
-		}
-	}
 
-	void Librarian::downloadEditBuffer(std::shared_ptr<SafeMidiOutput> midiOutput, std::shared_ptr<Synth> synth, ProgressHandler *progressHandler, TFinishedHandler onFinished)
-	{
-		// First things first - this should not be called more than once at a time, and there should be no other Librarian callback handlers be registered!
-		jassert(handles_.empty());
-		clearHandlers();
+			// Forget about the sessions that are done
+			activeSessions_.erase(std::remove_if(activeSessions_.begin(), activeSessions_.end(), [](std::shared_ptr<DownloadSession> const &s) { return s->hasEnded(); }), activeSessions_.end());
 
-		// Ok, for this we need to send a program change message, and then a request edit buffer message from the active synth
-		// Once we get that, store the patch and increment number by one
-		downloadNumber_ = 0;
-		currentDownload_.clear();
-		onFinished_ = onFinished;
-		auto editBufferCapability = midikraft::Capability::hasCapability<EditBufferCapability>(synth);
-		auto streamLoading = midikraft::Capability::hasCapability<StreamLoadCapability>(synth);
-		auto programDumpCapability = midikraft::Capability::hasCapability<ProgramDumpCabability>(synth);
-		auto programChangeCapability = midikraft::Capability::hasCapability<SendsProgramChangeCapability>(synth);
-		auto handle = MidiController::makeOneHandle();
-		if (streamLoading) {
-			// Simple enough, we hope
-			MidiController::instance()->addMessageHandler(handle, [this, synth, progressHandler, midiOutput](MidiInput *source, const juce::MidiMessage &editBuffer) {
-				ignoreUnused(source);
-				this->handleNextStreamPart(midiOutput, synth, progressHandler, editBuffer, StreamLoadCapability::StreamType::EDIT_BUFFER_DUMP);
-			});
-			handles_.push(handle);
-			currentDownload_.clear();
-			auto messages = streamLoading->requestStreamElement(0, StreamLoadCapability::StreamType::EDIT_BUFFER_DUMP);
-			synth->sendBlockOfMessagesToSynth(midiOutput->deviceInfo(), messages);
-		} else if (editBufferCapability) {
-			MidiController::instance()->addMessageHandler(handle, [this, synth, progressHandler, midiOutput](MidiInput *source, const juce::MidiMessage &editBuffer) {
-				ignoreUnused(source);
-				this->handleNextEditBuffer(midiOutput, synth, progressHandler, editBuffer, MidiBankNumber::fromZeroBase(0, SynthBank::numberOfPatchesInBank(synth, 0)));
-			});
-			handles_.push(handle);
-			// Special case - load only a single patch. In this case we're interested in the edit buffer only!
-			startDownloadNumber_ = 0;
-			endDownloadNumber_ = 1;
-			startDownloadNextEditBuffer(midiOutput, synth, false); // No program change required, we want exactly one edit buffer, the current one
-		}
-		else if (programDumpCapability && programChangeCapability) {
-			auto messages = programDumpCapability->requestPatch(programChangeCapability->lastProgramChange().toZeroBased());
-			synth->sendBlockOfMessagesToSynth(midiOutput->deviceInfo(), messages);
+			// Only one session can talk to a MIDI output at a time, sessions on other outputs run in parallel
+			for (auto const &active : activeSessions_) {
+				if (active->outputIdentifier() == session->outputIdentifier()) {
+					outputBusy = true;
+					break;
+				}
+			}
+			if (outputBusy) {
+				pendingSessions_.emplace_back(session, start);
+			}
+			else {
+				activeSessions_.push_back(session);
+			}
 		}
-		else {
-			SimpleLogger::instance()->postMessage("The " + synth->getName() + " has no way to request the edit buffer or program place");
+		if (!outputBusy) {
+			start();
 		}
 	}
 
-	void Librarian::startDownloadingSequencerData(std::shared_ptr<SafeMidiOutput> midiOutput, DataFileLoadCapability *sequencer, int dataFileIdentifier, ProgressHandler *progressHandler, TStepSequencerFinishedHandler onFinished)
+	// How many finished downloads we remember the statistics of
+	const size_t kMaxFinishedStatistics = 20;
+
+	DownloadSession::TSessionEndedHandler Librarian::sessionEndedHandler()
 	{
-		// First things first - this should not be called more than once at a time, and there should be no other Librarian callback handlers be registered!
-		jassert(handles_.empty());
-		clearHandlers();
+		auto lifetime = lifetime_;
+		return [this, lifetime](DownloadSession *ended) {
+			ScopedLock lock(lifetime->lock);
+			if (lifetime->alive) {
+				sessionEnded(ended);
+			}
+		};
+	}
 
-		downloadNumber_ = 0;
-		currentDownload_.clear();
-		onSequencerFinished_ = onFinished;
-
-		auto handle = MidiController::makeOneHandle();
-		MidiController::instance()->addMessageHandler(handle, [this, sequencer, progressHandler, midiOutput, dataFileIdentifier](MidiInput *source, const MidiMessage &message) {
-			ignoreUnused(source);
-			if (sequencer->isDataFile(message, dataFileIdentifier)) {
-				currentDownload_.push_back(message);
-				downloadNumber_++;
-				if (downloadNumber_ >= sequencer->numberOfDataItemsPerType(dataFileIdentifier)) {
-					auto loadedData = sequencer->loadData(currentDownload_, dataFileIdentifier);
-					clearHandlers();
-					onSequencerFinished_(loadedData);
-					if (progressHandler) progressHandler->onSuccess();
-				}
-				else if (progressHandler->shouldAbort()) {
-					clearHandlers();					
-					if (progressHandler) progressHandler->onCancel();
-				}
-				else {
-					startDownloadNextDataItem(midiOutput, sequencer, dataFileIdentifier);
-					if (progressHandler) progressHandler->setProgressPercentage(downloadNumber_ / (double)sequencer->numberOfDataItemsPerType(dataFileIdentifier));
+	void Librarian::sessionEnded(DownloadSession *session)
+	{
+		// Called on the MIDI worker or the parser thread, from within the session
+		std::shared_ptr<DownloadSession> ended;
+		std::shared_ptr<DownloadSession> nextSession;
+		std::function<void()> next;
+		{
+			ScopedLock lock(sessionLock_);
+			finishedStatistics_.push_back(session->statistics());
+			while (finishedStatistics_.size() > kMaxFinishedStatistics) {
+				finishedStatistics_.pop_front();
+			}
+			auto found = std::find_if(activeSessions_.begin(), activeSessions_.end(), [session](std::shared_ptr<DownloadSession> const &s) { return s.get() == session; });
+			if (found != activeSessions_.end()) {
+				ended = *found;
+				activeSessions_.erase(found);
+			}
+			for (auto waiting = pendingSessions_.begin(); waiting != pendingSessions_.end(); waiting++) {
+				if (waiting->first->outputIdentifier() == session->outputIdentifier()) {
+					activeSessions_.push_back(waiting->first);
+					nextSession = waiting->first;
+					next = waiting->second;
+					pendingSessions_.erase(waiting);
+					break;
 				}
 			}
-		});
-		handles_.push(handle);
-		startDownloadNextDataItem(midiOutput, sequencer, dataFileIdentifier);
+		}
+		if (ended || next) {
+			// Start the next session waiting for this output on the message thread, like the first one. The ended session is let go there
+			// too, after it has returned from the handler that ended it
+			auto lifetime = lifetime_;
+			MessageManager::callAsync([lifetime, ended, nextSession, next]() {
+				ScopedLock lock(lifetime->lock);
+				if (next && lifetime->alive && !nextSession->hasEnded()) {
+					next();
+				}
+			});
+		}
 	}
 
 	Synth *Librarian::sniffSynth(std::vector<MidiMessage> const &messages) const
 	{
 		std::set<Synth *> result;
-		for (auto message : messages) {
-			for (auto synth : synths_) {
-				if (synth.synth() && synth.synth()->isOwnSysex(message)) {
-					result.insert(synth.synth().get());
-				}
+		for (auto const &message : messages) {
+			for (auto const &synth : headerIndex_->synthsForMessage(message)) {
+				result.insert(synth.get());
 			}
 		}
 		if (result.size() > 1) {
@@ -296,17 +206,24 @@ namespace midikraft {
 		}
 
 		void run() {
-			int filesDiscovered = files_.size();
-			int filesDone = 0;
-			for (auto fileChosen : files_) {
-				if (threadShouldExit()) {
-					return;
-				}
-				setProgress(filesDone / (double)filesDiscovered);
-				auto pathChosen = fileChosen.getFullPathName().toStdString();
-				auto newPatches = librarian_->loadSysexPatchesFromDisk(synth_, pathChosen, fileChosen.getFileName().toStdString(), automaticCategories_);
-				std::copy(newPatches.begin(), newPatches.end(), std::back_inserter(result_));
-				filesDone++;
+			// Load the files on all cores, and merge them in the order they were chosen
+			std::vector<File> files(files_.begin(), files_.end());
+			std::vector<std::vector<PatchHolder>> loaded;
+			std::vector<int> outcome;
+			if (!librarian_->loadPatchFiles(synth_, files, automaticCategories_, nullptr, [this](double progress) {
+				setProgress(progress);
+				return !threadShouldExit();
+			}, loaded, outcome)) {
+				return;
+			}
+
+			size_t total = 0;
+			for (auto const &patches : loaded) {
+				total += patches.size();
+			}
+			result_.reserve(total);
+			for (auto &patches : loaded) {
+				std::move(patches.begin(), patches.end(), std::back_inserter(result_));
 			}
 		}
 
@@ -331,18 +248,79 @@ namespace midikraft {
 		}
 	}
 
-	std::vector<PatchHolder> Librarian::loadSysexPatchesFromDisk(std::shared_ptr<Synth> synth, std::shared_ptr<AutomaticCategory> automaticCategories)
+	// Sysex and MIDI files bigger than this are streamed, smaller ones are loaded in one go
+	const int64 kStreamFileBytes = 32 * 1024 * 1024;
+
+	bool Librarian::loadPatchFiles(std::shared_ptr<Synth> synth, std::vector<File> const &files, std::shared_ptr<AutomaticCategory> automaticCategories, TSkipFile skip,
+		std::function<bool(double)> onProgress, std::vector<std::vector<PatchHolder>> &loaded, std::vector<int> &outcome, std::vector<std::vector<std::string>> *knownFingerprints)
 	{
-		updateLastPath(lastPath_, "lastImportPath");
+		int numFiles = (int)files.size();
+		loaded.assign(files.size(), {});
+		outcome.assign(files.size(), 0);
+		if (knownFingerprints) {
+			knownFingerprints->assign(files.size(), {});
+		}
 
-		std::string standardFileExtensions = "*.syx;*.mid;*.zip;*.txt;*.json";
+		// Sysex and MIDI files can be split into messages without the synth. Ask it about its own formats here, not on the readers
 		auto legacyLoader = midikraft::Capability::hasCapability<LegacyLoaderCapability>(synth);
-		if (legacyLoader) {
-			standardFileExtensions += ";" + legacyLoader->additionalFileExtensions();
+		std::vector<bool> splittable(files.size());
+		for (size_t i = 0; i < files.size(); i++) {
+			auto path = files[i].getFullPathName();
+			splittable[i] = MappedPatchFile::canStream(path) && !(legacyLoader && legacyLoader->supportsExtension(path.toStdString())) && files[i].getSize() <= kStreamFileBytes;
+		}
+
+		// Each job reads, parses and tags one file. Only the synth's parsing is done under the lock, as a synth is not made to be
+		// called from several threads, the fingerprints and the automatic categories are done in parallel
+		CriticalSection parseLock;
+		std::atomic<bool> canceled(false);
+		std::atomic<int> done(0);
+		WaitableEvent fileDone;
+		ThreadPool readers(std::max(1, std::min(SystemStats::getNumCpus(), numFiles)));
+		for (int i = 0; i < numFiles; i++) {
+			readers.addJob([this, synth, automaticCategories, &files, &splittable, &loaded, &outcome, knownFingerprints, &parseLock, &canceled, &done, &fileDone, skip, i]() {
+				if (!canceled) {
+					auto const &file = files[(size_t)i];
+					auto known = knownFingerprints ? &(*knownFingerprints)[(size_t)i] : nullptr;
+					if (skip && skip(i)) {
+						outcome[(size_t)i] = 1;
+					}
+					else if (splittable[(size_t)i]) {
+						auto messages = MappedPatchFile::loadSysex(file.getFullPathName().toStdString());
+						std::map<std::shared_ptr<Synth>, int> places;
+						loaded[(size_t)i] = loadMessagesFromFile(synth, messages, file.getFullPathName().toStdString(), file.getFileName().toStdString(), "", automaticCategories, places, &parseLock, known);
+						outcome[(size_t)i] = 2;
+					}
+					else {
+						// Archives, interchange format, legacy and huge files
+						ScopedLock lock(parseLock);
+						loaded[(size_t)i] = loadSysexPatchesFromDisk(synth, file.getFullPathName().toStdString(), file.getFileName().toStdString(), automaticCategories, known);
+						outcome[(size_t)i] = 2;
+					}
+				}
+				done++;
+				fileDone.signal();
+			});
 		}
 
+		bool completed = true;
+		while (done < numFiles) {
+			fileDone.wait();
+			if (completed && onProgress && !onProgress(done / (double)numFiles)) {
+				// Files not started yet are skipped, we wait only for those being worked on right now
+				completed = false;
+				canceled = true;
+			}
+		}
+		readers.removeAllJobs(true, -1);
+		return completed;
+	}
+
+	std::vector<PatchHolder> Librarian::loadSysexPatchesFromDisk(std::shared_ptr<Synth> synth, std::shared_ptr<AutomaticCategory> automaticCategories)
+	{
+		updateLastPath(lastPath_, "lastImportPath");
+
 		FileChooser sysexChooser("Please select the sysex or other patch file you want to load...",
-			File(lastPath_), standardFileExtensions);
+			File(lastPath_), importFileExtensions(synth));
 		if (sysexChooser.browseForMultipleFilesToOpen())
 		{
 			if (sysexChooser.getResults().size() > 0) {
@@ -369,48 +347,390 @@ namespace midikraft {
 		return std::vector<PatchHolder>();
 	}
 
-	std::vector<PatchHolder> Librarian::loadSysexPatchesFromDisk(std::shared_ptr<Synth> synth, std::string const &fullpath, std::string const &filename, std::shared_ptr<AutomaticCategory> automaticCategories) {
+	std::string Librarian::importFileExtensions(std::shared_ptr<Synth> synth)
+	{
+		std::string standardFileExtensions = "*.syx;*.mid;*.zip;*.txt;*.json";
+		auto legacyLoader = midikraft::Capability::hasCapability<LegacyLoaderCapability>(synth);
+		if (legacyLoader) {
+			standardFileExtensions += ";" + legacyLoader->additionalFileExtensions();
+		}
+		return standardFileExtensions;
+	}
+
+	DirectoryRescan Librarian::rescanDirectory(std::shared_ptr<Synth> synth, File const &directory, DirectoryScanCache &cache, std::shared_ptr<AutomaticCategory> automaticCategories, ProgressHandler *progressHandler)
+	{
+		DirectoryRescan result;
+
+		// Only the directory listing is needed to find out which files to look at
+		struct Candidate {
+			File file;
+			bool isNew;
+			DirectoryScanCache::Entry cached;
+		};
+		std::vector<Candidate> candidates;
+		std::set<std::string> seen;
+		for (auto const &file : directory.findChildFiles(File::findFiles, true, importFileExtensions(synth))) {
+			auto path = file.getFullPathName().toStdString();
+			seen.insert(path);
+			DirectoryScanCache::Entry cached;
+			bool known = cache.lookup(path, cached);
+			if (known && cached.size == file.getSize() && cached.modified == file.getLastModificationTime().toMilliseconds()) {
+				result.unchangedFiles++;
+			}
+			else {
+				candidates.push_back({ file, !known, cached });
+			}
+		}
+		for (auto const &path : cache.pathsBelow(directory)) {
+			if (seen.find(path) == seen.end()) {
+				result.removedFiles.push_back(path);
+				cache.remove(path);
+			}
+		}
+
+		// Hash and read the new and changed files on all cores, and parse them in the order of the directory listing
+		std::vector<File> files;
+		for (auto const &candidate : candidates) {
+			files.push_back(candidate.file);
+		}
+		std::vector<DirectoryScanCache::Entry> entries(candidates.size());
+		auto unchangedContent = [&candidates, &entries](int i) {
+			auto const &candidate = candidates[(size_t)i];
+			auto &entry = entries[(size_t)i];
+			entry.size = candidate.file.getSize();
+			entry.modified = candidate.file.getLastModificationTime().toMilliseconds();
+			entry.contentHash = DirectoryScanCache::contentHash(candidate.file);
+			if (!candidate.isNew && entry.contentHash == candidate.cached.contentHash) {
+				// Only touched, no need to parse it again
+				entry.fingerprints = candidate.cached.fingerprints;
+				return true;
+			}
+			return false;
+		};
+		std::vector<std::vector<PatchHolder>> loaded;
+		std::vector<int> outcome; // 0 not done, 1 unchanged content, 2 parsed
+		std::vector<std::vector<std::string>> known; // Of the patches not imported again because they are in the database already
+		result.completed = loadPatchFiles(synth, files, automaticCategories, unchangedContent, [progressHandler](double progress) {
+			if (progressHandler) {
+				// The files not parsed stay out of date in the cache, the next rescan picks them up
+				progressHandler->setProgressPercentage(progress);
+				return !progressHandler->shouldAbort();
+			}
+			return true;
+		}, loaded, outcome, &known);
+
+		for (size_t i = 0; i < candidates.size(); i++) {
+			auto path = candidates[i].file.getFullPathName().toStdString();
+			if (outcome[i] == 1) {
+				result.unchangedFiles++;
+				cache.update(path, entries[i]);
+			}
+			else if (outcome[i] == 2) {
+				entries[i].fingerprints = known[i];
+				for (auto const &patch : loaded[i]) {
+					entries[i].fingerprints.push_back(patch.md5());
+				}
+				cache.update(path, entries[i]);
+				(candidates[i].isNew ? result.newFiles : result.modifiedFiles).push_back(path);
+				std::move(loaded[i].begin(), loaded[i].end(), std::back_inserter(result.patches));
+			}
+		}
+		SimpleLogger::instance()->postMessage(fmt::format("Rescanned {}: {} new, {} modified, {} removed and {} unchanged files", directory.getFullPathName().toStdString(),
+			result.newFiles.size(), result.modifiedFiles.size(), result.removedFiles.size(), result.unchangedFiles));
+		return result;
+	}
+
+
+	std::vector<PatchHolder> Librarian::loadSysexPatchesFromDisk(std::shared_ptr<Synth> synth, std::string const &fullpath, std::string const &filename, std::shared_ptr<AutomaticCategory> automaticCategories,
+		std::vector<std::string> *knownFingerprints) {
 		auto legacyLoader = midikraft::Capability::hasCapability<LegacyLoaderCapability>(synth);
 		TPatchVector patches;
 		if (legacyLoader && legacyLoader->supportsExtension(fullpath)) {
-			File legacyFile = File::createFileWithoutCheckingPath(fullpath);
-			if (legacyFile.existsAsFile()) {
-				FileInputStream inputStream(legacyFile);
-				std::vector<uint8> data((size_t)inputStream.getTotalLength());
-				inputStream.read(&data[0], (int)inputStream.getTotalLength()); // 4 GB Limit
+			MappedPatchFile legacyFile(File::createFileWithoutCheckingPath(fullpath));
+			if (legacyFile.isOpen()) {
+				// The loader wants its own vector, copy straight from the mapped file
+				std::vector<uint8> data(legacyFile.data(), legacyFile.data() + legacyFile.size());
 				patches = legacyLoader->load(fullpath, data);
 			}
 		}
 		else if (File(fullpath).getFileExtension() == ".json") {
 			std::map<std::string, std::shared_ptr<Synth>> synths;
 			synths[synth->getName()] = synth;
-			return PatchInterchangeFormat::load(synths, fullpath, automaticCategories);
+			std::shared_ptr<FingerprintIndex> knownPatches;
+			{
+				ScopedLock lock(sessionLock_);
+				knownPatches = knownPatches_;
+			}
+			return PatchInterchangeFormat::load(synths, fullpath, automaticCategories, knownPatches);
+		}
+		else if (File(fullpath).hasFileExtension(".zip")) {
+			return loadPatchesFromZip(synth, fullpath, filename, automaticCategories, knownFingerprints);
+		}
+		else if (MappedPatchFile::canStream(fullpath) && File(fullpath).getSize() > kStreamFileBytes) {
+			// Too big to have all messages in memory at once
+			std::vector<PatchHolder> result;
+			streamSysexPatchesFromDisk(synth, fullpath, filename, automaticCategories, [&result](std::vector<PatchHolder> &&patches) {
+				std::move(patches.begin(), patches.end(), std::back_inserter(result));
+				return true;
+			}, knownFingerprints);
+			return result;
 		}
 		else {
-			auto messagesLoaded = Sysex::loadSysex(fullpath);
-			if (synth) {
-				patches = synth->loadSysex(messagesLoaded);
+			auto messagesLoaded = MappedPatchFile::loadSysex(fullpath);
+			std::map<std::shared_ptr<Synth>, int> places;
+			return loadMessagesFromFile(synth, messagesLoaded, fullpath, filename, "", automaticCategories, places, nullptr, knownFingerprints);
+		}
+		return tagPatchesFromFile(synth, patches, fullpath, filename, automaticCategories, 0, "", knownFingerprints);
+	}
+
+	std::vector<PatchHolder> Librarian::loadMessagesFromFile(std::shared_ptr<Synth> synth, std::vector<MidiMessage> const &messages, std::string const &fullpath, std::string const &filename,
+		std::string const &archiveMember, std::shared_ptr<AutomaticCategory> automaticCategories, std::map<std::shared_ptr<Synth>, int> &places, CriticalSection *parseLock,
+		std::vector<std::string> *knownFingerprints)
+	{
+		auto parse = [parseLock](std::shared_ptr<Synth> parser, std::vector<MidiMessage> const &toParse) {
+			if (parseLock) {
+				ScopedLock lock(*parseLock);
+				return parser->loadSysex(toParse);
 			}
+			return parser->loadSysex(toParse);
+		};
+
+		std::vector<PatchHolder> result;
+		if (synth) {
+			auto patches = parse(synth, messages);
+			result = tagPatchesFromFile(synth, patches, fullpath, filename, automaticCategories, places[synth], archiveMember, knownFingerprints);
+			places[synth] += (int)patches.size();
+		}
+
+		if (!result.empty()) {
+			return result;
 		}
 
-		if (patches.empty()) {
-			// Bugger - probably the file is for some synth that is correctly not the active one... happens frequently for me
-			// Let's try to sniff the synth from the magics given and then try to reload the file with the correct synth
-			//auto detectedSynth = sniffSynth(messagesLoaded);
-			//if (detectedSynth) {
-				// That's better, now try again
-				//patches = detectedSynth->loadSysex(messagesLoaded);
-			//}
+		// Nothing for the active synth, but the file might be for another synth, or contain the patches of several synths. This happens
+		// frequently for me, so route the messages to the synths claiming them and load those with the right synth, in the order of their names
+		for (auto const &routed : headerIndex_->route(messages)) {
+			auto const &other = routed.second.synth;
+			if (other != synth) {
+				auto otherPatches = parse(other, routed.second.messages);
+				if (!otherPatches.empty()) {
+					SimpleLogger::instance()->postMessage(fmt::format("Found {} patches for the {} in {}", otherPatches.size(), other->getName(), archiveMember.empty() ? filename : archiveMember));
+					auto otherResult = tagPatchesFromFile(other, otherPatches, fullpath, filename, automaticCategories, places[other], archiveMember, knownFingerprints);
+					places[other] += (int)otherPatches.size();
+					std::move(otherResult.begin(), otherResult.end(), std::back_inserter(result));
+				}
+			}
+		}
+		return result;
+	}
+
+	std::vector<PatchHolder> Librarian::loadPatchesFromZip(std::shared_ptr<Synth> synth, std::string const &fullpath, std::string const &filename, std::shared_ptr<AutomaticCategory> automaticCategories,
+		std::vector<std::string> *knownFingerprints)
+	{
+		MappedPatchFile archive(File::createFileWithoutCheckingPath(fullpath));
+		if (!archive.isOpen()) {
+			return {};
+		}
+		// The zip reads through the mapping
+		ZipFile zip(new MemoryInputStream(archive.data(), archive.size(), false), true);
+		auto legacyLoader = midikraft::Capability::hasCapability<LegacyLoaderCapability>(synth);
+		struct Member {
+			std::string name;
+			bool isLegacy = false;
+			bool isPatchFile = false;
+			std::vector<uint8> legacyData;
+			std::vector<MidiMessage> messages;
+		};
+		int numEntries = zip.getNumEntries();
+		std::vector<Member> members((size_t)numEntries);
+		for (int i = 0; i < numEntries; i++) {
+			auto entry = zip.getEntry(i);
+			if (entry) {
+				// The entry names are relative, so look at the name only and don't make a File of it
+				auto &member = members[(size_t)i];
+				member.name = entry->filename.toStdString();
+				member.isLegacy = legacyLoader && legacyLoader->supportsExtension(member.name);
+				member.isPatchFile = member.isLegacy || MappedPatchFile::canStream(entry->filename);
+			}
+		}
+
+		// Inflating and splitting doesn't involve the synth, so it can run on several threads
+		auto readMember = [&zip, &members](int i) {
+			auto &member = members[(size_t)i];
+			std::unique_ptr<InputStream> stream(zip.createStreamForEntry(i));
+			if (!stream) {
+				return;
+			}
+			MemoryBlock data;
+			stream->readIntoMemoryBlock(data);
+			auto bytes = static_cast<uint8 const *>(data.getData());
+			if (member.isLegacy) {
+				member.legacyData.assign(bytes, bytes + data.getSize());
+			}
+			else {
+				MappedPatchFile::forEachSysex(bytes, data.getSize(), MappedPatchFile::isMidiFile(member.name), [&member](MidiMessage const &message) {
+					member.messages.push_back(message);
+					return true;
+				});
+			}
+		};
+		int numPatchFiles = (int)std::count_if(members.begin(), members.end(), [](Member const &member) { return member.isPatchFile; });
+		if (ThreadPoolJob::getCurrentThreadPoolJob() || numPatchFiles < 2) {
+			// Already on a worker of a multi file import, which keeps the cores busy
+			for (int i = 0; i < numEntries; i++) {
+				if (members[(size_t)i].isPatchFile) {
+					readMember(i);
+				}
+			}
+		}
+		else {
+			ThreadPool workers(std::max(1, std::min(SystemStats::getNumCpus(), numPatchFiles)));
+			for (int i = 0; i < numEntries; i++) {
+				if (members[(size_t)i].isPatchFile) {
+					workers.addJob([&readMember, i]() { readMember(i); });
+				}
+			}
+			while (workers.getNumJobs() > 0) {
+				Thread::sleep(1);
+			}
+		}
+
+		// The synth parses on this thread only, in the order of the archive
+		std::vector<PatchHolder> result;
+		for (auto &member : members) {
+			std::vector<PatchHolder> loaded;
+			if (member.isLegacy) {
+				auto patches = legacyLoader->load(member.name, member.legacyData);
+				loaded = tagPatchesFromFile(synth, patches, fullpath, filename, automaticCategories, 0, member.name, knownFingerprints);
+			}
+			else if (member.isPatchFile) {
+				std::map<std::shared_ptr<Synth>, int> places;
+				loaded = loadMessagesFromFile(synth, member.messages, fullpath, filename, member.name, automaticCategories, places, nullptr, knownFingerprints);
+			}
+			std::move(loaded.begin(), loaded.end(), std::back_inserter(result));
+		}
+		return result;
+	}
+
+	// Messages handed to the synth's loadSysex at once when streaming a file
+	const size_t kStreamBatchMessages = 512;
+	// A dump not recognized after that many messages probably never will be, the rest of the file is then loaded in one go
+	const size_t kStreamMaxDumpMessages = 4096;
+
+	// The dump formats of a synth, to find the end of a dump while streaming
+	size_t Librarian::streamSysexPatchesFromDisk(std::shared_ptr<Synth> synth, std::string const &fullpath, std::string const &filename, std::shared_ptr<AutomaticCategory> automaticCategories, TPatchBatchHandler onPatches,
+		std::vector<std::string> *knownFingerprints)
+	{
+		File file(fullpath);
+		MappedPatchFile mapped(file);
+		if (!mapped.isOpen()) {
+			return 0;
+		}
+
+		// Batches are only cut after a complete dump, so no patch is split between two calls to loadSysex
+		std::vector<MidiMessage> batch;
+		std::vector<MidiMessage> dump;
+		std::map<std::shared_ptr<Synth>, DumpFormats> formats; // Looked up once per synth found in the file
+		DumpFormats const *dumpFormats = nullptr;
+		bool unrecognized = false;
+		std::map<std::shared_ptr<Synth>, int> places; // Next program place of the patches of each synth in this file
+		size_t found = 0;
+		bool stopped = false;
+		auto loadBatch = [&]() {
+			if (batch.empty()) {
+				return;
+			}
+			auto result = loadMessagesFromFile(synth, batch, fullpath, filename, "", automaticCategories, places, nullptr, knownFingerprints);
+			batch.clear();
+			found += result.size();
+			if (!result.empty() && !onPatches(std::move(result))) {
+				stopped = true;
+			}
+		};
+
+		mapped.forEachSysex(MappedPatchFile::isMidiFile(fullpath), [&](MidiMessage const &message) {
+			if (unrecognized) {
+				dump.push_back(message);
+				return true;
+			}
+			if (dump.empty()) {
+				auto owners = headerIndex_->synthsForMessage(message);
+				if (owners.empty() && !synth->isOwnSysex(message)) {
+					// Nobody's, it can't start a dump
+					return !stopped;
+				}
+				auto dumpSynth = owners.empty() ? synth : owners.front();
+				auto known = formats.find(dumpSynth);
+				if (known == formats.end()) {
+					known = formats.emplace(dumpSynth, DumpFormats(dumpSynth)).first;
+				}
+				dumpFormats = &known->second;
+			}
+			dump.push_back(message);
+			if (dumpFormats->isCompleteDump(dump)) {
+				std::move(dump.begin(), dump.end(), std::back_inserter(batch));
+				dump.clear();
+			}
+			else if (dump.size() > 1 && dumpFormats->isCompleteDump({ message })) {
+				// Whatever came before never became a dump
+				dump.clear();
+				batch.push_back(message);
+			}
+			else if (dump.size() >= kStreamMaxDumpMessages) {
+				if (dumpFormats->knowsDumpEnd()) {
+					// The leading message doesn't start a dump, drop it so we find the next one that does
+					dump.erase(dump.begin());
+				}
+				else {
+					// The synth has no format we can find the end of, so don't cut anywhere from here on
+					SimpleLogger::instance()->postMessage(fmt::format("Can't find the end of the dumps in {}, loading the rest of it at once", filename));
+					unrecognized = true;
+				}
+			}
+			if (batch.size() >= kStreamBatchMessages) {
+				loadBatch();
+			}
+			return !stopped;
+		});
+		if (!stopped) {
+			std::move(dump.begin(), dump.end(), std::back_inserter(batch));
+			loadBatch();
+		}
+		return found;
+	}
+
+	std::vector<PatchHolder> Librarian::tagPatchesFromFile(std::shared_ptr<Synth> synth, TPatchVector const &patches, std::string const &fullpath, std::string const &filename, std::shared_ptr<AutomaticCategory> automaticCategories,
+		int firstPlace /* = 0 */, std::string const &archiveMember /* = "" */, std::vector<std::string> *knownFingerprints /* = nullptr */) const
+	{
+		std::shared_ptr<FingerprintIndex> knownPatches;
+		{
+			ScopedLock lock(sessionLock_);
+			knownPatches = knownPatches_;
 		}
 
 		// Add the meta information
 		std::vector<PatchHolder> result;
-		int i = 0;
+		int i = firstPlace;
+		int skipped = 0;
 		for (auto patch : patches) {
-			result.push_back(PatchHolder(synth, std::make_shared<FromFileSource>(filename, fullpath, MidiProgramNumber::fromZeroBase(i)), patch,
+			if (knownPatches && synth) {
+				auto fingerprint = synth->calculateFingerprint(patch);
+				if (knownPatches->contains(synth->getName(), fingerprint)) {
+					// Already in the database, categorizing it again would be wasted. It keeps its place though
+					if (knownFingerprints) {
+						knownFingerprints->push_back(fingerprint);
+					}
+					skipped++;
+					i++;
+					continue;
+				}
+			}
+			result.push_back(PatchHolder(synth, std::make_shared<FromFileSource>(filename, fullpath, MidiProgramNumber::fromZeroBase(i), archiveMember), patch,
 				MidiBankNumber::fromZeroBase(0, SynthBank::numberOfPatchesInBank(synth, 0)), MidiProgramNumber::fromZeroBase(i), automaticCategories));
 			i++;
 		}
+		if (skipped > 0) {
+			SimpleLogger::instance()->postMessage(fmt::format("Skipped {} patches from {} which are already in the database", skipped, archiveMember.empty() ? filename : archiveMember));
+		}
 		return result;
 	}
 
@@ -431,176 +751,385 @@ namespace midikraft {
 		return result;
 	}
 
-	void Librarian::sendBankToSynth(SynthBank const& synthBank, bool fullBank, ProgressHandler* progressHandler, std::function<void(bool completed)> finishedHandler)
+	std::shared_ptr<SysexCapture> Librarian::startSysexCapture(MidiDeviceInfo const &input, std::shared_ptr<AutomaticCategory> automaticCategories, SysexCapture::TPatchesHandler onPatches)
+	{
+		return std::make_shared<SysexCapture>(input, headerIndex_, automaticCategories, onPatches);
+	}
+
+	// Every outcome of an upload reaches the caller the same way, later on the message thread
+	static void reportUploadFinished(std::function<void(bool completed)> finishedHandler, bool completed)
+	{
+		if (finishedHandler) {
+			MessageManager::callAsync([finishedHandler, completed]() { finishedHandler(completed); });
+		}
+	}
+
+	void Librarian::sendBankToSynth(SynthBank const& synthBank, bool fullBank, std::shared_ptr<ProgressHandler> progressHandler, std::function<void(bool completed)> finishedHandler, std::function<void(MidiProgramNumber)> onPatchSent /* = nullptr */,
+		bool verify /* = false */)
 	{
 		auto synth = synthBank.synth();
 		if (!synth) {
 			return;
 		}
 
-		auto programDumpCapability = midikraft::Capability::hasCapability<ProgramDumpCabability>(synth);
-		if (programDumpCapability) {
-			// Count how many to send first
-			int count = 0;
-			int i = 0;
-			for (auto const& patch : synthBank.patches()) {
-				ignoreUnused(patch);
-				if (fullBank || synthBank.isPositionDirty(i++)) {
-					count++;
-				}
-			}
-
-			auto location = midikraft::Capability::hasCapability<midikraft::MidiLocationCapability>(synth);
-			if (!location || !location->channel().isValid() /* || !synth->wasDetected()*/) {
-				SimpleLogger::instance()->postMessage(fmt::format("Synth {} is currently not detected, please turn on and re-run connectivity check", synth->getName()));
-				return;
+		// Collect what needs to be sent, the bank might change while we are uploading
+		std::map<int, PatchHolder> toSend;
+		int i = 0;
+		for (auto const& patch : synthBank.patches()) {
+			if (fullBank || synthBank.isPositionDirty(i)) {
+				toSend[i] = patch;
 			}
+			i++;
+		}
 
-			// Now to send and update the progressHandler
-			int sent = 0;
-			i = 0;
-			for (auto const& patch : synthBank.patches()) {
-				if (progressHandler) progressHandler->setMessage(fmt::format("Sending patch {} to {}", patch.name(), synth->friendlyProgramName(patch.patchNumber())));
-				if (fullBank || synthBank.isPositionDirty(i++)) {
-					auto messages = programDumpCapability->patchToProgramDumpSysex(patch.patch(), patch.patchNumber());
-					synth->sendBlockOfMessagesToSynth(location->midiOutput(), messages);
-				}
-				if (progressHandler) progressHandler->setProgressPercentage(++sent / (double) count);
-				if (progressHandler && progressHandler->shouldAbort()) {
-					SimpleLogger::instance()->postMessage("Canceled bank upload in mid-flight!");
-					if (finishedHandler) {
-						finishedHandler(false);
-					}
+		auto bankNo = synthBank.bankNumber();
+		if (verify) {
+			auto lifetime = lifetime_;
+			auto uploaded = [this, lifetime, synth, bankNo, toSend, progressHandler, finishedHandler](bool completed) {
+				ScopedLock guard(lifetime->lock);
+				if (!lifetime->alive) {
 					return;
 				}
-			}
-			if (finishedHandler) {
-				finishedHandler(true);
-			}
+				if (completed) {
+					verifyUpload(synth, bankNo, toSend, progressHandler, 1, finishedHandler);
+				}
+				else {
+					reportUploadFinished(finishedHandler, false);
+				}
+			};
+			uploadPatches(synth, bankNo, toSend, progressHandler, uploaded, onPatchSent);
 		}
 		else {
-			SimpleLogger::instance()->postMessage(fmt::format("Sending banks to {} is not implemented yet", synth->getName()));
+			uploadPatches(synth, bankNo, toSend, progressHandler, finishedHandler, onPatchSent);
 		}
 	}
 
-	class ExportSysexFilesInBackground: public ThreadWithProgressWindow {
-	public:
-		ExportSysexFilesInBackground(String title, File dest, Librarian::ExportParameters params, std::vector<PatchHolder> const &patches) : ThreadWithProgressWindow(title, true, false),
-			destination(dest), params(params), patches(patches)
-		{}
+	void Librarian::sendBankToSynth(SynthBank const& synthBank, bool fullBank, ProgressHandler *progressHandler, std::function<void(bool completed)> finishedHandler, std::function<void(MidiProgramNumber)> onPatchSent /* = nullptr */,
+		bool verify /* = false */)
+	{
+		// The caller keeps ownership
+		std::shared_ptr<ProgressHandler> borrowed(progressHandler, [](ProgressHandler *) {});
+		sendBankToSynth(synthBank, fullBank, progressHandler ? borrowed : nullptr, finishedHandler, onPatchSent, verify);
+	}
 
-		virtual void run() override
+	void Librarian::uploadPatches(std::shared_ptr<Synth> synth, MidiBankNumber bankNo, std::map<int, PatchHolder> const &toSend, std::shared_ptr<ProgressHandler> progressHandler,
+		std::function<void(bool completed)> finishedHandler, std::function<void(MidiProgramNumber)> onPatchSent)
+	{
+		// If this bank is uploading already, the patches just join the queue
+		auto key = BankUpload::uploadKey(synth, bankNo);
+		ScopedLock lock(uploadLock_);
+		auto running = uploads_.find(key);
+		if (running != uploads_.end() && running->second->addPatches(toSend, onPatchSent, finishedHandler)) {
+			return;
+		}
+		auto upload = std::make_shared<BankUpload>(synth, bankNo, progressHandler);
+		upload->addPatches(toSend, onPatchSent, finishedHandler);
 		{
-			if (destination.existsAsFile()) {
-				destination.deleteFile();
+			ScopedLock sessionLock(sessionLock_);
+			if (virtualSynth_ && virtualSynth_->synth() == synth) {
+				upload->sendTo(virtualSynth_);
 			}
-			else if (destination.exists() && params.fileOption != Librarian::MANY_FILES) {
-				// This is a directory, but we didn't want one
-				SimpleLogger::instance()->postMessage("Can't overwrite a directory, please choose a different name!");
-				return;
+		}
+		uploads_[key] = upload;
+		uploader_->addJob([this, key, upload]() {
+			upload->run();
+			// Patches for this bank need a new upload from now on, unless one has been started already
+			ScopedLock lock(uploadLock_);
+			auto entry = uploads_.find(key);
+			if (entry != uploads_.end() && entry->second == upload) {
+				uploads_.erase(entry);
 			}
+		});
+	}
+
+	// For the verification download when the caller didn't give us a progress handler
+	class SilentProgress : public ProgressHandler {
+	public:
+		virtual bool shouldAbort() const override { return false; }
+		virtual void setProgressPercentage(double zeroToOne) override { ignoreUnused(zeroToOne); }
+		virtual void onSuccess() override {}
+		virtual void onCancel() override {}
+		virtual void setMessage(std::string const &message) override { ignoreUnused(message); }
+	};
 
-			// Create a temporary directory to build the result
-			TemporaryDirectory tempDir("KnobKraftOrm", "sysex_export_tmp");
-
-			// Now, iterate over the list of patches and pack them one by one into the zip file!		
-			ZipFile::Builder builder;
-			std::vector<MidiMessage> allMessages;
-			int count = 0;
-			for (const auto& patch : patches) {
-				if (patch.patch()) {
-					std::vector<MidiMessage> sysexMessages;
-					switch (params.formatOption) {
-					case Librarian::PROGRAM_DUMPS:
-					{
-						// Let's see if we have program dump capability for the synth!
-						auto pdc = Capability::hasCapability<ProgramDumpCabability>(patch.synth());
-						if (pdc) {
-							sysexMessages = pdc->patchToProgramDumpSysex(patch.patch(), patch.patchNumber());
-							break;
+	// Collects the read back patches, and also learns when the download did not complete
+	class VerificationSink : public DownloadSink {
+	public:
+		typedef std::function<void(bool completed, std::vector<PatchHolder> const &patches)> THandler;
+		VerificationSink(THandler handler) : handler_(handler) {}
+
+		virtual void bankDownloaded(MidiBankNumber bankNo, std::vector<PatchHolder> &&patches) override {
+			ignoreUnused(bankNo);
+			std::move(patches.begin(), patches.end(), std::back_inserter(readBack_));
+		}
+
+		virtual void downloadFinished(bool completed) override {
+			handler_(completed, readBack_);
+		}
+
+	private:
+		THandler handler_;
+		std::vector<PatchHolder> readBack_;
+	};
+
+	void Librarian::verifyUpload(std::shared_ptr<Synth> synth, MidiBankNumber bankNo, std::map<int, PatchHolder> const &sent, std::shared_ptr<ProgressHandler> progressHandler, int resendsLeft,
+		std::function<void(bool completed)> finishedHandler)
+	{
+		auto reportBack = [finishedHandler](bool verified) {
+			reportUploadFinished(finishedHandler, verified);
+		};
+		if (sent.empty()) {
+			// Nothing was written, so there is nothing to read back
+			reportBack(true);
+			return;
+		}
+		auto location = midikraft::Capability::hasCapability<MidiLocationCapability>(synth);
+		auto midiOutput = location ? MidiController::instance()->getMidiOutput(location->midiOutput()) : nullptr;
+		bool standIn;
+		{
+			// The session reads back from the virtual synth if we uploaded to it, it needs no output then
+			ScopedLock lock(sessionLock_);
+			standIn = virtualSynth_ && virtualSynth_->synth() == synth;
+		}
+		if (!midiOutput && !standIn) {
+			SimpleLogger::instance()->postMessage(fmt::format("Can't verify upload to {}, no MIDI output", synth->getName()));
+			reportBack(false);
+			return;
+		}
+
+		// Read back only the positions written, all in one pipelined download
+		std::set<int> programs;
+		int firstProgram = SynthBank::startIndexInBank(synth, bankNo);
+		for (auto const &patch : sent) {
+			programs.insert(firstProgram + patch.first);
+		}
+		// The session only gets the raw pointer, the handlers below keep the progress handler alive until it is done
+		std::shared_ptr<ProgressHandler> progress = progressHandler ? progressHandler : std::make_shared<SilentProgress>();
+		progress->setMessage(fmt::format("Verifying {} on {}", SynthBank::friendlyBankName(synth, bankNo), synth->getName()));
+		auto session = std::make_shared<DownloadSession>(midiOutput, progress.get(), sessionEndedHandler(), parser_.get());
+		auto lifetime = lifetime_;
+		scheduleSession(session, synth->getName(), [this, lifetime, session, synth, bankNo, sent, programs, progressHandler, resendsLeft, finishedHandler, reportBack, progress, standIn]() {
+			session->startDownloadingPrograms(synth, bankNo, programs, std::make_shared<VerificationSink>([this, lifetime, synth, bankNo, sent, progressHandler, resendsLeft, finishedHandler, reportBack, progress, standIn](bool completed, std::vector<PatchHolder> const &readBack) {
+				ScopedLock guard(lifetime->lock);
+				if (!lifetime->alive) {
+					return;
+				}
+				if (!completed) {
+					SimpleLogger::instance()->postMessage(fmt::format("Verification of the upload to {} was canceled", synth->getName()));
+					reportBack(false);
+					return;
+				}
+				// Program dump and edit buffer synths deliver just the positions asked for, bank dump and stream synths the whole bank
+				std::map<int, PatchHolder> mismatches;
+				if (readBack.size() == sent.size()) {
+					size_t i = 0;
+					for (auto const &patch : sent) {
+						if (readBack[i++].md5() != patch.second.md5()) {
+							mismatches.insert(patch);
 						}
-						// fall through do default then
 					}
-					default:
-					case Librarian::EDIT_BUFFER_DUMPS:
-						// Every synth is forced to have an implementation for this
-						sysexMessages = patch.synth()->dataFileToSysex(patch.patch(), nullptr);
-						break;
+				}
+				else if ((int)readBack.size() == SynthBank::numberOfPatchesInBank(synth, bankNo)) {
+					for (auto const &patch : sent) {
+						if (patch.first >= (int)readBack.size() || readBack[patch.first].md5() != patch.second.md5()) {
+							mismatches.insert(patch);
+						}
 					}
+				}
+				else {
+					SimpleLogger::instance()->postMessage(fmt::format("Verification got {} patches back for {} sent, sending all again", readBack.size(), sent.size()));
+					mismatches = sent;
+				}
 
-					String fileName = patch.name();
-					switch (params.fileOption) {
-					case Librarian::MANY_FILES:
-					{
-						std::string result = Sysex::saveSysexIntoNewFile(destination.getFullPathName().toStdString(), File::createLegalFileName(fileName.trim()).toStdString(), sysexMessages);
-						break;
-					}
-					case Librarian::ZIPPED_FILES:
-					{
-						std::string result = Sysex::saveSysexIntoNewFile(tempDir.name(), File::createLegalFileName(fileName.trim()).toStdString(), sysexMessages);
-						builder.addFile(File(result), 6);
-						break;
-					}
-					case Librarian::MID_FILE:
-					case Librarian::ONE_FILE:
-					{
-						std::copy(sysexMessages.begin(), sysexMessages.end(), std::back_inserter(allMessages));
+				// Missing patches most likely mean we were sending too fast. The losses of a stand-in say nothing about the real synth
+				if (!standIn) {
+					RequestPacing pacing(synth, RequestPacing::Mode::UPLOAD);
+					pacing.transferVerified(mismatches.empty());
+					pacing.persist();
+				}
+
+				if (mismatches.empty()) {
+					SimpleLogger::instance()->postMessage(fmt::format("Verified {} patches on {}", sent.size(), synth->getName()));
+					reportBack(true);
+				}
+				else if (resendsLeft > 0) {
+					SimpleLogger::instance()->postMessage(fmt::format("{} of {} patches did not arrive correctly on {}, sending them again", mismatches.size(), sent.size(), synth->getName()));
+					uploadPatches(synth, bankNo, mismatches, progressHandler, [this, lifetime, synth, bankNo, mismatches, progressHandler, resendsLeft, finishedHandler](bool completed) {
+						ScopedLock guard(lifetime->lock);
+						if (!lifetime->alive) {
+							return;
+						}
+						if (completed) {
+							verifyUpload(synth, bankNo, mismatches, progressHandler, resendsLeft - 1, finishedHandler);
+						}
+						else {
+							reportUploadFinished(finishedHandler, false);
+						}
+					}, nullptr);
+				}
+				else {
+					SimpleLogger::instance()->postMessage(fmt::format("Error: {} patches could not be stored on {}", mismatches.size(), synth->getName()));
+					reportBack(false);
+				}
+			}));
+		});
+	}
+
+	// Runs the export behind a progress window. There is no cancel button, the export is only aborted when the thread is told to stop
+	class ExportSysexFilesInBackground: public ThreadWithProgressWindow, private ProgressHandler {
+	public:
+		ExportSysexFilesInBackground(String title, File dest, Librarian::ExportParameters params, std::vector<PatchHolder> const &patches) : ThreadWithProgressWindow(title, true, false),
+			destination(dest), params(params), patches(patches), exported_(false)
+		{}
+
+		virtual void run() override
+		{
+			exported_ = Librarian::exportSysexPatches(params, patches, destination, this);
+		}
+
+		bool exported() const {
+			return exported_;
+		}
+
+	private:
+		virtual bool shouldAbort() const override { return threadShouldExit(); }
+		virtual void setProgressPercentage(double zeroToOne) override { setProgress(zeroToOne); }
+		virtual void onSuccess() override {}
+		virtual void onCancel() override {}
+		virtual void setMessage(std::string const &message) override { setStatusMessage(message); }
+
+		File destination;
+		Librarian::ExportParameters params;
+		std::vector<PatchHolder> const &patches;
+		bool exported_;
+	};
+
+	bool Librarian::exportSysexPatches(ExportParameters params, std::vector<PatchHolder> const &patches, File destination, ProgressHandler *progressHandler)
+	{
+		if (destination.isDirectory() && params.fileOption != Librarian::MANY_FILES) {
+			// This is a directory, but we didn't want one
+			SimpleLogger::instance()->postMessage("Can't overwrite a directory, please choose a different name!");
+			return false;
+		}
+
+		// Create a temporary directory to build the result
+		TemporaryDirectory tempDir("KnobKraftOrm", "sysex_export_tmp");
+
+		// Now, iterate over the list of patches and pack them one by one into the zip file!		
+		ZipFile::Builder builder;
+		std::vector<MidiMessage> allMessages;
+		std::vector<File> written; // The files put into the destination directory so far
+		bool aborted = false;
+		int count = 0;
+		for (const auto& patch : patches) {
+			if (patch.patch()) {
+				std::vector<MidiMessage> sysexMessages;
+				switch (params.formatOption) {
+				case Librarian::PROGRAM_DUMPS:
+				{
+					// Let's see if we have program dump capability for the synth!
+					auto pdc = Capability::hasCapability<ProgramDumpCabability>(patch.synth());
+					if (pdc) {
+						sysexMessages = pdc->patchToProgramDumpSysex(patch.patch(), patch.patchNumber());
 						break;
 					}
-					}
+					// fall through do default then
+				}
+				default:
+				case Librarian::EDIT_BUFFER_DUMPS:
+					// Every synth is forced to have an implementation for this
+					sysexMessages = patch.synth()->dataFileToSysex(patch.patch(), nullptr);
+					break;
 				}
-				setProgress(count++ / (double)patches.size());
-				if (threadShouldExit()) {
+
+				String fileName = patch.name();
+				switch (params.fileOption) {
+				case Librarian::MANY_FILES:
+				{
+					std::string result = Sysex::saveSysexIntoNewFile(destination.getFullPathName().toStdString(), File::createLegalFileName(fileName.trim()).toStdString(), sysexMessages);
+					written.push_back(File(result));
+					break;
+				}
+				case Librarian::ZIPPED_FILES:
+				{
+					std::string result = Sysex::saveSysexIntoNewFile(tempDir.name(), File::createLegalFileName(fileName.trim()).toStdString(), sysexMessages);
+					builder.addFile(File(result), 6);
 					break;
 				}
+				case Librarian::MID_FILE:
+				case Librarian::ONE_FILE:
+				{
+					std::copy(sysexMessages.begin(), sysexMessages.end(), std::back_inserter(allMessages));
+					break;
+				}
+				}
 			}
-			switch (params.fileOption)
-			{
-			case Librarian::ZIPPED_FILES:
-			{
-				FileOutputStream targetStream(destination);
-				builder.writeToStream(targetStream, nullptr);
-				break;
+			if (progressHandler) {
+				progressHandler->setProgressPercentage(count++ / (double)patches.size());
+				if (progressHandler->shouldAbort()) {
+					aborted = true;
+					break;
+				}
 			}
-			case Librarian::ONE_FILE:
-			{
-				Sysex::saveSysex(destination.getFullPathName().toStdString(), allMessages);
-				break;
+		}
+		if (aborted) {
+			// Don't leave half an export behind, and keep a file we would have replaced
+			for (auto &file : written) {
+				file.deleteFile();
+			}
+			SimpleLogger::instance()->postMessage("Export canceled");
+			return false;
+		}
+
+		if (destination.existsAsFile()) {
+			destination.deleteFile();
+		}
+		switch (params.fileOption)
+		{
+		case Librarian::ZIPPED_FILES:
+		{
+			FileOutputStream targetStream(destination);
+			if (targetStream.failedToOpen() || !builder.writeToStream(targetStream, nullptr)) {
+				SimpleLogger::instance()->postMessage("ERROR: Failed to write ZIP file to " + destination.getFullPathName());
+				return false;
+			}
+			break;
+		}
+		case Librarian::ONE_FILE:
+		{
+			Sysex::saveSysex(destination.getFullPathName().toStdString(), allMessages);
+			break;
+		}
+		case Librarian::MID_FILE:
+		{
+			MidiFile midiFile;
+			MidiMessageSequence mmSeq;
+			for (const auto& msg : allMessages) {
+				mmSeq.addEvent(msg, 0.0);
 			}
-			case Librarian::MID_FILE:
-			{
-				MidiFile midiFile;
-				MidiMessageSequence mmSeq;
-				for (const auto& msg : allMessages) {
-					mmSeq.addEvent(msg, 0.0);
-				}
 
-				// Add to track 1 of MIDI file
-				midiFile.addTrack(mmSeq);
-				midiFile.setTicksPerQuarterNote(96);
+			// Add to track 1 of MIDI file
+			midiFile.addTrack(mmSeq);
+			midiFile.setTicksPerQuarterNote(96);
 
-				// Done, write to file
-				File file(destination);
-				if (file.existsAsFile()) {
-					file.deleteFile();
-				}
-				FileOutputStream stream(file);
-				if (!midiFile.writeTo(stream, 1)) {
-					SimpleLogger::instance()->postMessage("ERROR: Failed to write SMF file to " + destination.getFullPathName());
-				}
-				stream.flush();
+			// Done, write to file
+			File file(destination);
+			if (file.existsAsFile()) {
+				file.deleteFile();
 			}
-			default:
-				// Nothing to do
-				break;
+			FileOutputStream stream(file);
+			if (!midiFile.writeTo(stream, 1)) {
+				SimpleLogger::instance()->postMessage("ERROR: Failed to write SMF file to " + destination.getFullPathName());
+				return false;
 			}
+			stream.flush();
 		}
-
-	private:
-		File destination;
-		Librarian::ExportParameters params;
-		std::vector<PatchHolder> const &patches;
-	};
+		default:
+			// Nothing to do
+			break;
+		}
+		return true;
+	}
 
 	void Librarian::saveSysexPatchesToDisk(ExportParameters params, std::vector<PatchHolder> const &patches)
 	{
@@ -655,6 +1184,12 @@ namespace midikraft {
 		ExportSysexFilesInBackground progressWindow("Exporting...", destination, params, patches);
 
 		if (progressWindow.runThread()) {
+			if (!progressWindow.exported()) {
+				// Nothing was written, the log has the reason
+				AlertWindow::showMessageBox(AlertWindow::WarningIcon, "Export failed",
+					fmt::format("The patches could not be exported to:\n\n{}\n\nPlease check the log for details", destination.getFullPathName().toStdString()));
+				return;
+			}
 			// Done, now just wrap up
 			switch (params.fileOption) {
 			case MANY_FILES:
@@ -683,227 +1218,101 @@ namespace midikraft {
 
 	void Librarian::clearHandlers()
 	{
-		// This is to clear up any remaining MIDI callback handlers, e.g. on User canceling an operation
-		while (!handles_.empty()) {
-			auto handle = handles_.top();
-			handles_.pop();
-			MidiController::instance()->removeMessageHandler(handle);
+		// This is to stop all running downloads, e.g. on User canceling an operation
+		std::vector<std::shared_ptr<DownloadSession>> toAbort;
+		{
+			ScopedLock lock(sessionLock_);
+			pendingSessions_.clear();
+			toAbort = activeSessions_;
+		}
+		for (auto &session : toAbort) {
+			session->abort();
 		}
 	}
 
-	void Librarian::startDownloadNextEditBuffer(std::shared_ptr<SafeMidiOutput> midiOutput, std::shared_ptr<Synth> synth, bool sendProgramChange) {
-		// Get all commands
-		std::vector<MidiMessage> messages;
-		auto editBufferCapability = midikraft::Capability::hasCapability<EditBufferCapability>(synth);
-		if (editBufferCapability) {
-			currentEditBuffer_.clear();
-			auto midiLocation = midikraft::Capability::hasCapability<MidiLocationCapability>(synth);
-			if (midiLocation) {
-				if (sendProgramChange) {
-					messages.push_back(MidiMessage::programChange(midiLocation->channel().toOneBasedInt(), downloadNumber_));
-				}
-				auto requestMessages = editBufferCapability->requestEditBufferDump();
-				std::copy(requestMessages.cbegin(), requestMessages.cend(), std::back_inserter(messages));
-			}
-			else {
-				SimpleLogger::instance()->postMessage("Error: Can't send to synth because no MIDI location implemented for it");
-			}
-		}
-		else {
-			SimpleLogger::instance()->postMessage("Failure: This synth does not implement any valid capability to start downloading a full bank");
-			downloadNumber_ = endDownloadNumber_; 
-		}
+	std::string downloadWindowKey(std::shared_ptr<Synth> synth) {
+		return fmt::format("{}-downloadWindow", synth->getName());
+	}
 
-		// Send messages
-		if (!messages.empty()) {
-			synth->sendBlockOfMessagesToSynth(midiOutput->deviceInfo(), messages);
+	int Librarian::downloadWindowSize(std::shared_ptr<Synth> synth)
+	{
+		if (!synth) {
+			return 1;
 		}
+		int windowSize = String(Settings::instance().get(downloadWindowKey(synth), "1")).getIntValue();
+		return std::max(1, windowSize);
 	}
 
-	void Librarian::startDownloadNextPatch(std::shared_ptr<SafeMidiOutput> midiOutput, std::shared_ptr<Synth> synth) {
-		// Get all commands
-		std::vector<MidiMessage> messages;
-		auto programDumpCapability = midikraft::Capability::hasCapability<ProgramDumpCabability>(synth);
-		if (programDumpCapability) {
-			currentProgramDump_.clear();
-			messages = programDumpCapability->requestPatch(downloadNumber_);
-		}		
-		else {
-			SimpleLogger::instance()->postMessage("Failure: This synth does not implement any valid capability to start downloading a full bank");
-			downloadNumber_ = endDownloadNumber_;
+	void Librarian::setDownloadWindowSize(std::shared_ptr<Synth> synth, int windowSize)
+	{
+		if (synth) {
+			Settings::instance().set(downloadWindowKey(synth), fmt::format("{}", std::max(1, windowSize)));
 		}
+	}
 
-		// Send messages
-		if (!messages.empty()) {
-			synth->sendBlockOfMessagesToSynth(midiOutput->deviceInfo(), messages);
-		}
+	void Librarian::setTrafficLog(std::shared_ptr<MidiTrafficLog> trafficLog)
+	{
+		ScopedLock lock(sessionLock_);
+		trafficLog_ = trafficLog;
 	}
 
-	void Librarian::startDownloadNextDataItem(std::shared_ptr<SafeMidiOutput> midiOutput, DataFileLoadCapability *sequencer, int dataFileIdentifier) {
-		std::vector<MidiMessage> request = sequencer->requestDataItem(downloadNumber_, dataFileIdentifier);
-		// If this is a synth, it has a throttled send method
-		auto synth = dynamic_cast<Synth *>(sequencer);
-		if (synth) {
-			synth->sendBlockOfMessagesToSynth(midiOutput->deviceInfo(), request);
-		}
-		else {
-			// This is not a synth... fall back to old behavior
-			midiOutput->sendBlockOfMessagesFullSpeed(request);
-		}
+	void Librarian::setTrafficReplay(std::shared_ptr<MidiTrafficReplay> replay)
+	{
+		ScopedLock lock(sessionLock_);
+		trafficReplay_ = replay;
 	}
 
-	void Librarian::handleNextStreamPart(std::shared_ptr<SafeMidiOutput> midiOutput, std::shared_ptr<Synth> synth, ProgressHandler *progressHandler, const juce::MidiMessage &message, StreamLoadCapability::StreamType streamType)
+	void Librarian::setVirtualSynth(std::shared_ptr<VirtualSynth> virtualSynth)
 	{
-		auto streamLoading = midikraft::Capability::hasCapability<StreamLoadCapability>(synth);
-		if (streamLoading) {
-			if (streamLoading->isMessagePartOfStream(message, streamType)) {
-				currentDownload_.push_back(message);
-				int progressTotal = streamLoading->numberOfStreamMessagesExpected(streamType);
-				if (progressTotal > 0 && progressHandler) {
-					progressHandler->setProgressPercentage(currentDownload_.size() / (double)progressTotal);
-				}
-				if (streamLoading->isStreamComplete(currentDownload_, streamType)) {
-					clearHandlers();
-					auto result = synth->loadSysex(currentDownload_);
-					onFinished_(tagPatchesWithImportFromSynth(synth, result, currentDownloadBank_));
-					if (progressHandler) progressHandler->onSuccess();
-				}
-				else if (progressHandler && progressHandler->shouldAbort()) {
-					clearHandlers();
-					progressHandler->onCancel();
-				}
-				else if (streamLoading->shouldStreamAdvance(currentDownload_, streamType)) {
-					downloadNumber_++;
-					auto messages = streamLoading->requestStreamElement(downloadNumber_, streamType);
-					synth->sendBlockOfMessagesToSynth(midiOutput->deviceInfo(), messages);
-					if (progressTotal == -1 && progressHandler) progressHandler->setProgressPercentage(downloadNumber_ / (double)expectedDownloadNumber_);
-				}
-			}
-		}
-		else {
-			jassertfalse;
-		}
-	}
-
-	void Librarian::handleNextEditBuffer(std::shared_ptr<SafeMidiOutput> midiOutput, std::shared_ptr<Synth> synth, ProgressHandler *progressHandler, const juce::MidiMessage &editBuffer, MidiBankNumber bankNo) {
-		auto editBufferCapability = midikraft::Capability::hasCapability<EditBufferCapability>(synth);
-		// This message might be a part of a multi-message program dump?
-		if (editBufferCapability) {
-			auto handshake = editBufferCapability->isMessagePartOfEditBuffer(editBuffer);
-			if (handshake.isPartOfEditBufferDump) {
-				// See if we should send a reply (ACK)
-				if (!handshake.handshakeReply.empty()) {
-					synth->sendBlockOfMessagesToSynth(midiOutput->deviceInfo(), handshake.handshakeReply);
-				}
-				currentEditBuffer_.push_back(editBuffer);
-				if (editBufferCapability->isEditBufferDump(currentEditBuffer_)) {
-					// Ok, that worked, save it and continue!
-					std::copy(currentEditBuffer_.begin(), currentEditBuffer_.end(), std::back_inserter(currentDownload_));
-
-					// Finished?
-					if (downloadNumber_ >= endDownloadNumber_ - 1) {
-						clearHandlers();
-						auto patches = synth->loadSysex(currentDownload_);
-						onFinished_(tagPatchesWithImportFromSynth(synth, patches, bankNo));
-						if (progressHandler) progressHandler->onSuccess();
-					}
-					else if (progressHandler->shouldAbort()) {
-						clearHandlers();
-						if (progressHandler) progressHandler->onCancel();
-					}
-					else {
-						downloadNumber_++;
-						startDownloadNextEditBuffer(midiOutput, synth, true); // To continue with more than one download makes only sense if we send program change commands
-						if (progressHandler) progressHandler->setProgressPercentage((downloadNumber_ - startDownloadNumber_) / (double)(endDownloadNumber_ - startDownloadNumber_));
-					}
-				}
-			}
-		}
-		else {
-			// Ignore message
-		}
-	}
-
-	void Librarian::handleNextProgramBuffer(std::shared_ptr<SafeMidiOutput> midiOutput, std::shared_ptr<Synth> synth, ProgressHandler* progressHandler, const juce::MidiMessage& editBuffer, MidiBankNumber bankNo) {
-		auto programDumpCapability = midikraft::Capability::hasCapability<ProgramDumpCabability>(synth);
-		// This message might be a part of a multi-message program dump?
-		if (programDumpCapability) {
-			auto handshake = programDumpCapability->isMessagePartOfProgramDump(editBuffer);
-			if (handshake.isPartOfProgramDump) {
-				currentProgramDump_.push_back(editBuffer);
-				// See if we should send a reply (ACK)
-				if (!handshake.handshakeReply.empty()) {
-					synth->sendBlockOfMessagesToSynth(midiOutput->deviceInfo(), handshake.handshakeReply);
-				}
-				if (programDumpCapability->isSingleProgramDump(currentProgramDump_)) {
-					// Ok, that worked, save it and continue!
-					std::copy(currentProgramDump_.begin(), currentProgramDump_.end(), std::back_inserter(currentDownload_));
-
-					// Finished?
-					if (downloadNumber_ >= endDownloadNumber_ - 1) {
-						clearHandlers();
-						auto patches = synth->loadSysex(currentDownload_);
-						onFinished_(tagPatchesWithImportFromSynth(synth, patches, bankNo));
-						if (progressHandler) progressHandler->onSuccess();
-					}
-					else if (progressHandler->shouldAbort()) {
-						clearHandlers();
-						if (progressHandler) progressHandler->onCancel();
-					}
-					else {
-						downloadNumber_++;
-						startDownloadNextPatch(midiOutput, synth);
-						if (progressHandler) progressHandler->setProgressPercentage((downloadNumber_ - startDownloadNumber_) / (double)(endDownloadNumber_ - startDownloadNumber_));
-					}
-				}
-			}
-		}
+		ScopedLock lock(sessionLock_);
+		virtualSynth_ = virtualSynth;
 	}
 
-	void Librarian::handleNextBankDump(std::shared_ptr<SafeMidiOutput> midiOutput, std::shared_ptr<Synth> synth, ProgressHandler *progressHandler, const juce::MidiMessage &bankDump, MidiBankNumber bankNo)
+	void Librarian::setKnownPatches(std::shared_ptr<FingerprintIndex> knownPatches)
 	{
-		ignoreUnused(midiOutput); //TODO why?
-		auto bankDumpCapability = midikraft::Capability::hasCapability<BankDumpCapability>(synth);
-		if (bankDumpCapability && bankDumpCapability->isBankDump(bankDump)) {
-			currentDownload_.push_back(bankDump);
-			if (bankDumpCapability->isBankDumpFinished(currentDownload_)) {
-				clearHandlers();
-				auto patches = synth->loadSysex(currentDownload_);
-				onFinished_(tagPatchesWithImportFromSynth(synth, patches, bankNo));
-				progressHandler->onSuccess();
-			}
-			else if (progressHandler->shouldAbort()) {
-				clearHandlers();				
-				progressHandler->onCancel();
-			}
-			else {
-				progressHandler->setProgressPercentage(currentDownload_.size() / (double)(expectedDownloadNumber_));
-			}
-		}
+		ScopedLock lock(sessionLock_);
+		knownPatches_ = knownPatches;
 	}
 
-	std::vector<PatchHolder> Librarian::tagPatchesWithImportFromSynth(std::shared_ptr<Synth> synth, TPatchVector &patches, MidiBankNumber bankNo) {
-		std::vector<PatchHolder> result;
-		auto now = Time::getCurrentTime();
-		int i = 0;
-		for (auto patch : patches) {
-			MidiProgramNumber place = MidiProgramNumber::fromZeroBase(i++);
-			auto realpatch = std::dynamic_pointer_cast<Patch>(patch);
-			if (realpatch) {
-				place = realpatch->patchNumber();
+	std::string sequencerWindowKey(DataFileLoadCapability *sequencer) {
+		auto device = dynamic_cast<NamedDeviceCapability *>(sequencer);
+		return fmt::format("{}-sequencerWindow", device ? device->getName() : "sequencer");
+	}
+
+	int Librarian::sequencerWindowSize(DataFileLoadCapability *sequencer)
+	{
+		int windowSize = String(Settings::instance().get(sequencerWindowKey(sequencer), "1")).getIntValue();
+		return std::max(1, windowSize);
+	}
+
+	void Librarian::setSequencerWindowSize(DataFileLoadCapability *sequencer, int windowSize)
+	{
+		Settings::instance().set(sequencerWindowKey(sequencer), fmt::format("{}", std::max(1, windowSize)));
+	}
+
+	std::vector<DownloadStatistics> Librarian::downloadStatistics() const
+	{
+		ScopedLock lock(sessionLock_);
+		std::vector<DownloadStatistics> result(finishedStatistics_.begin(), finishedStatistics_.end());
+		for (auto const &session : activeSessions_) {
+			if (!session->hasEnded()) {
+				result.push_back(session->statistics());
 			}
-			result.push_back(PatchHolder(synth, std::make_shared<FromSynthSource>(now, bankNo), patch, bankNo, place));
 		}
 		return result;
 	}
 
-	void Librarian::tagPatchesWithMultiBulkImport(std::vector<PatchHolder> &patches) {
-		// We have multiple import sources, so we need to modify the SourceInfo in the patches with a BulkImport info
-		Time now = Time::getCurrentTime();
-		for (auto &patch : patches) {
-			auto bulkInfo = std::make_shared<FromBulkImportSource>(now, patch.sourceInfo());
-			patch.setSourceInfo(bulkInfo);
+	bool Librarian::writeDownloadStatistics(File const &file) const
+	{
+		std::string lines;
+		for (auto const &stats : downloadStatistics()) {
+			lines += stats.toJson() + "\n";
+		}
+		if (!file.replaceWithText(lines)) {
+			SimpleLogger::instance()->postMessage("Failed to write download statistics to " + file.getFullPathName());
+			return false;
 		}
+		return true;
 	}
 
 }
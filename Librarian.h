@@ -17,22 +17,38 @@
 #include "DataFileLoadCapability.h"
 #include "StreamLoadCapability.h"
 #include "SynthBank.h"
+#include "DownloadSession.h"
+#include "BankUpload.h"
+#include "SysexHeaderIndex.h"
+#include "SysexCapture.h"
+#include "MidiTrafficReplay.h"
+#include "VirtualSynth.h"
+#include "FingerprintIndex.h"
+#include "DirectoryScanCache.h"
 
-#include <stack>
+#include <deque>
 
 namespace midikraft {
 
 	class Synth;
+	class LoadManyPatchFiles;
 
 	class Librarian {
 	public:
-		typedef std::function<void(std::vector<PatchHolder>)> TFinishedHandler;
-		typedef std::function<void(std::vector<std::shared_ptr<DataFile>>)> TStepSequencerFinishedHandler;
+		typedef DownloadSession::TFinishedHandler TFinishedHandler;
+		typedef DownloadSession::TStepSequencerFinishedHandler TStepSequencerFinishedHandler;
+		typedef DownloadSession::TPatchLoadedHandler TPatchLoadedHandler;
 
-		Librarian(std::vector<SynthHolder> const &synths) : synths_(synths), currentDownloadBank_(MidiBankNumber::invalid()), downloadNumber_(0), startDownloadNumber_(0), endDownloadNumber_(0) {}
+		Librarian(std::vector<SynthHolder> const &synths) : synths_(synths), headerIndex_(std::make_shared<SysexHeaderIndex>(synths)), midiWorker_(std::make_shared<MidiWorker>()), checkpoints_(std::make_shared<DownloadCheckpoints>()),
+			uploader_(std::make_unique<ThreadPool>(1)), parser_(std::make_unique<ThreadPool>(1)) {}
+		~Librarian();
 
-		void startDownloadingAllPatches(std::shared_ptr<SafeMidiOutput> midiOutput, std::shared_ptr<Synth> synth, MidiBankNumber bankNo, ProgressHandler *progressHandler, TFinishedHandler onFinished);
-		void startDownloadingAllPatches(std::shared_ptr<SafeMidiOutput> midiOutput, std::shared_ptr<Synth> synth, std::vector<MidiBankNumber> bankNo, ProgressHandler *progressHandler, TFinishedHandler onFinished);
+		// onPatchLoaded is called on the Librarian's parser thread for every patch as soon as it has been received and parsed,
+		// onFinished is called with all patches once the download is complete
+		void startDownloadingAllPatches(std::shared_ptr<SafeMidiOutput> midiOutput, std::shared_ptr<Synth> synth, MidiBankNumber bankNo, ProgressHandler *progressHandler, TFinishedHandler onFinished, TPatchLoadedHandler onPatchLoaded = nullptr);
+		void startDownloadingAllPatches(std::shared_ptr<SafeMidiOutput> midiOutput, std::shared_ptr<Synth> synth, std::vector<MidiBankNumber> bankNo, ProgressHandler *progressHandler, TFinishedHandler onFinished, TPatchLoadedHandler onPatchLoaded = nullptr);
+		// Hands over the patches bank by bank to the sink instead of delivering them all at the end
+		void startDownloadingAllPatches(std::shared_ptr<SafeMidiOutput> midiOutput, std::shared_ptr<Synth> synth, std::vector<MidiBankNumber> bankNo, ProgressHandler *progressHandler, std::shared_ptr<DownloadSink> sink, TPatchLoadedHandler onPatchLoaded = nullptr);
 
 		void downloadEditBuffer(std::shared_ptr<SafeMidiOutput> midiOutput, std::shared_ptr<Synth> synth, ProgressHandler *progressHandler, TFinishedHandler onFinished);
 
@@ -40,10 +56,32 @@ namespace midikraft {
 
 		Synth *sniffSynth(std::vector<MidiMessage> const &messages) const;
 		std::vector<PatchHolder> loadSysexPatchesFromDisk(std::shared_ptr<Synth> synth, std::shared_ptr<AutomaticCategory> automaticCategories);
-		std::vector<PatchHolder> loadSysexPatchesFromDisk(std::shared_ptr<Synth> synth, std::string const &fullpath, std::string const &filename, std::shared_ptr<AutomaticCategory> automaticCategories);
+		// knownFingerprints, if given, gets the fingerprints of the patches left out because they are already in the database
+		std::vector<PatchHolder> loadSysexPatchesFromDisk(std::shared_ptr<Synth> synth, std::string const &fullpath, std::string const &filename, std::shared_ptr<AutomaticCategory> automaticCategories,
+			std::vector<std::string> *knownFingerprints = nullptr);
+		// For huge .syx and .mid files: walks the file message by message and hands out the patches in batches as they are parsed,
+		// so memory use doesn't grow with the file. loadSysexPatchesFromDisk does this for files above 32 MB.
+		// Messages that don't belong to a dump are skipped. Only for a synth without a dump format we can find the end of, the rest is loaded at once
+		// Return false from onPatches to stop. Returns the number of patches found
+		typedef std::function<bool(std::vector<PatchHolder> &&patches)> TPatchBatchHandler;
+		size_t streamSysexPatchesFromDisk(std::shared_ptr<Synth> synth, std::string const &fullpath, std::string const &filename, std::shared_ptr<AutomaticCategory> automaticCategories, TPatchBatchHandler onPatches,
+			std::vector<std::string> *knownFingerprints = nullptr);
+		// Imports all patch files in the directory tree which are not in the cache or have changed since, and updates the cache.
+		// Files whose size and modification time are unchanged aren't even opened. Runs on the calling thread, which waits for the workers
+		DirectoryRescan rescanDirectory(std::shared_ptr<Synth> synth, File const &directory, DirectoryScanCache &cache, std::shared_ptr<AutomaticCategory> automaticCategories, ProgressHandler *progressHandler);
 		std::vector<PatchHolder> loadSysexPatchesManualDump(std::shared_ptr<Synth> synth, std::vector<MidiMessage> const &messages, std::shared_ptr<AutomaticCategory> automaticCategories);
-
-		void sendBankToSynth(SynthBank const& synthBank, bool fullBank, ProgressHandler *progressHandler, std::function<void(bool completed)> finishedHandler);
+		// Keeps listening on the input for manual dumps from any synth we know, and hands out the patches as they complete until the capture is destroyed
+		std::shared_ptr<SysexCapture> startSysexCapture(MidiDeviceInfo const &input, std::shared_ptr<AutomaticCategory> automaticCategories, SysexCapture::TPatchesHandler onPatches);
+
+		// Uploads the dirty positions, or the full bank, on a background thread and returns immediately. The handlers are called on the message thread,
+		// onPatchSent once for every patch that has been transmitted. With verify, the positions are read back afterwards and those that differ are sent once more,
+		// completed is then only true if everything arrived. The progress handler is kept until the upload has finished, and is called on the message thread.
+		// Unlike in earlier versions, the finished handler is called after sendBankToSynth has returned.
+		void sendBankToSynth(SynthBank const& synthBank, bool fullBank, std::shared_ptr<ProgressHandler> progressHandler, std::function<void(bool completed)> finishedHandler,
+			std::function<void(MidiProgramNumber)> onPatchSent = nullptr, bool verify = false);
+		// For callers that own their progress handler. It is not taken over, so it must stay alive until the finished handler has been called
+		void sendBankToSynth(SynthBank const& synthBank, bool fullBank, ProgressHandler *progressHandler, std::function<void(bool completed)> finishedHandler,
+			std::function<void(MidiProgramNumber)> onPatchSent = nullptr, bool verify = false);
 
 		enum ExportFormatOption {
 			PROGRAM_DUMPS = 0,
@@ -61,47 +99,105 @@ namespace midikraft {
 			int fileOption;
 		};
 		void saveSysexPatchesToDisk(ExportParameters params, std::vector<PatchHolder> const &patches);
+		// Does the export of saveSysexPatchesToDisk without asking the user, e.g. for benchmarks. Returns false if it couldn't write to the destination,
+		// or if the progress handler aborted it - then nothing is written and the destination is left as it was
+		static bool exportSysexPatches(ExportParameters params, std::vector<PatchHolder> const &patches, File destination, ProgressHandler *progressHandler = nullptr);
 
+		// Aborts all running download sessions, e.g. on the user canceling an operation
 		void clearHandlers();
 
-	private:
-		void startDownloadNextEditBuffer(std::shared_ptr<SafeMidiOutput> midiOutput, std::shared_ptr<Synth> synth, bool sendProgramChange);
-		void startDownloadNextPatch(std::shared_ptr<SafeMidiOutput> midiOutput, std::shared_ptr<Synth> synth);
-		void startDownloadNextDataItem(std::shared_ptr<SafeMidiOutput> midiOutput, DataFileLoadCapability *sequencer, int dataFileIdentifier);
-		void handleNextStreamPart(std::shared_ptr<SafeMidiOutput> midiOutput, std::shared_ptr<Synth> synth, ProgressHandler *progressHandler, const juce::MidiMessage &message, StreamLoadCapability::StreamType streamType);
-		void handleNextEditBuffer(std::shared_ptr<SafeMidiOutput> midiOutput, std::shared_ptr<Synth> synth, ProgressHandler *progressHandler, const juce::MidiMessage &editBuffer, MidiBankNumber bankNo);
-		void handleNextProgramBuffer(std::shared_ptr<SafeMidiOutput> midiOutput, std::shared_ptr<Synth> synth, ProgressHandler* progressHandler, const juce::MidiMessage& editBuffer, MidiBankNumber bankNo);
-		void handleNextBankDump(std::shared_ptr<SafeMidiOutput> midiOutput, std::shared_ptr<Synth> synth, ProgressHandler* progressHandler, const juce::MidiMessage& bankDump, MidiBankNumber bankNo);
+		// Number of program dump requests kept in flight while downloading a bank. 1 is classic stop-and-wait,
+		// larger values pipeline the requests. The setting is persisted per synth.
+		static int downloadWindowSize(std::shared_ptr<Synth> synth);
+		static void setDownloadWindowSize(std::shared_ptr<Synth> synth, int windowSize);
+		// The same for the data item requests of a sequencer
+		static int sequencerWindowSize(DataFileLoadCapability *sequencer);
+		static void setSequencerWindowSize(DataFileLoadCapability *sequencer, int windowSize);
+
+		// Timing of the running and the most recently finished downloads, oldest first
+		std::vector<DownloadStatistics> downloadStatistics() const;
+		// Writes the statistics as JSON lines, for comparing synths and settings
+		bool writeDownloadStatistics(File const &file) const;
+
+		// Record the MIDI traffic of all downloads started from now on, nullptr stops recording
+		void setTrafficLog(std::shared_ptr<MidiTrafficLog> trafficLog);
+		// Downloads from the replay's device are answered by the replay instead of the synth
+		void setTrafficReplay(std::shared_ptr<MidiTrafficReplay> replay);
+		// Downloads from the virtual synth's synth, and uploads to it, go to the emulation instead of the MIDI ports
+		void setVirtualSynth(std::shared_ptr<VirtualSynth> virtualSynth);
+		// Imports from files skip the patches in this index right after fingerprinting them, nullptr imports everything
+		void setKnownPatches(std::shared_ptr<FingerprintIndex> knownPatches);
 
-		std::vector<PatchHolder> tagPatchesWithImportFromSynth(std::shared_ptr<Synth> synth, TPatchVector &patches, MidiBankNumber bankNo);
-		void tagPatchesWithMultiBulkImport(std::vector<PatchHolder> &patches);
+	private:
+		friend class LoadManyPatchFiles;
+
+		// deviceName is the synth or sequencer downloaded from, a stand-in for it gets the session
+		void scheduleSession(std::shared_ptr<DownloadSession> session, std::string const &deviceName, std::function<void()> start);
+		void sessionEnded(DownloadSession *session);
+		DownloadSession::TSessionEndedHandler sessionEndedHandler();
+
+		void uploadPatches(std::shared_ptr<Synth> synth, MidiBankNumber bankNo, std::map<int, PatchHolder> const &toSend, std::shared_ptr<ProgressHandler> progressHandler,
+			std::function<void(bool completed)> finishedHandler, std::function<void(MidiProgramNumber)> onPatchSent);
+		void verifyUpload(std::shared_ptr<Synth> synth, MidiBankNumber bankNo, std::map<int, PatchHolder> const &sent, std::shared_ptr<ProgressHandler> progressHandler, int resendsLeft,
+			std::function<void(bool completed)> finishedHandler);
+
+		std::vector<PatchHolder> tagPatchesFromFile(std::shared_ptr<Synth> synth, TPatchVector const &patches, std::string const &fullpath, std::string const &filename, std::shared_ptr<AutomaticCategory> automaticCategories,
+			int firstPlace = 0, std::string const &archiveMember = "", std::vector<std::string> *knownFingerprints = nullptr) const;
+		// Loads the messages with the synth. If it finds nothing, the messages of other synths in there are loaded with their synth. places is the next program place per synth.
+		// If parseLock is given, only the synths' parsing is done under it
+		std::vector<PatchHolder> loadMessagesFromFile(std::shared_ptr<Synth> synth, std::vector<MidiMessage> const &messages, std::string const &fullpath, std::string const &filename,
+			std::string const &archiveMember, std::shared_ptr<AutomaticCategory> automaticCategories, std::map<std::shared_ptr<Synth>, int> &places, CriticalSection *parseLock = nullptr,
+			std::vector<std::string> *knownFingerprints = nullptr);
+		// Reads, parses and tags the files on all cores, with the synths parsing one file after the other, as a synth is not made to be called
+		// from several threads. skip runs on the worker threads and may leave a file out. outcome is 0 for the files not done, 1 for skipped and
+		// 2 for loaded ones. onProgress returns false to cancel, false is returned then. knownFingerprints gets those of the patches already in the database per file
+		typedef std::function<bool(int fileIndex)> TSkipFile;
+		bool loadPatchFiles(std::shared_ptr<Synth> synth, std::vector<File> const &files, std::shared_ptr<AutomaticCategory> automaticCategories, TSkipFile skip,
+			std::function<bool(double)> onProgress, std::vector<std::vector<PatchHolder>> &loaded, std::vector<int> &outcome, std::vector<std::vector<std::string>> *knownFingerprints = nullptr);
+		// Reads the members of the archive straight from memory in parallel, and parses them in order
+		std::vector<PatchHolder> loadPatchesFromZip(std::shared_ptr<Synth> synth, std::string const &fullpath, std::string const &filename, std::shared_ptr<AutomaticCategory> automaticCategories,
+			std::vector<std::string> *knownFingerprints = nullptr);
 
 		void updateLastPath(std::string &lastPathVariable, std::string const &settingsKey);
+		static std::string importFileExtensions(std::shared_ptr<Synth> synth);
 
 		std::vector<SynthHolder> synths_;
-		std::vector<MidiMessage> currentDownload_;
-		std::vector<MidiMessage> currentEditBuffer_;
-		std::vector<MidiMessage> currentProgramDump_;
-		MidiBankNumber currentDownloadBank_;
-		std::stack<MidiController::HandlerHandle> handles_;
-		TFinishedHandler onFinished_;
-		TStepSequencerFinishedHandler onSequencerFinished_;
-		int downloadNumber_;
-		int startDownloadNumber_;
-		int endDownloadNumber_;
-		int expectedDownloadNumber_;
-
-		// To download multiple banks. This needs to go into its own context object
-		TFinishedHandler nextBankHandler_;
-		std::vector<midikraft::PatchHolder> currentDownloadedPatches_;
-		int downloadBankNumber_;
-		//int endDownloadBankNumber_;
+		std::shared_ptr<SysexHeaderIndex> headerIndex_; // Shared with the captures, which may outlive us
+
+		// Runs the MIDI handlers of all sessions. Shared with them, so it is still there when a session outliving us closes its inboxes
+		std::shared_ptr<MidiWorker> midiWorker_;
+
+		// Sessions and uploads may call back after we are gone. Their callbacks check alive under the lock before touching us
+		struct Lifetime {
+			CriticalSection lock;
+			bool alive = true;
+		};
+		std::shared_ptr<Lifetime> lifetime_ = std::make_shared<Lifetime>();
+
+		// Download sessions currently running, and those waiting for their MIDI output to become free
+		mutable CriticalSection sessionLock_;
+		std::vector<std::shared_ptr<DownloadSession>> activeSessions_;
+		std::deque<std::pair<std::shared_ptr<DownloadSession>, std::function<void()>>> pendingSessions_;
+		std::deque<DownloadStatistics> finishedStatistics_;
+		std::shared_ptr<MidiTrafficLog> trafficLog_;
+		std::shared_ptr<MidiTrafficReplay> trafficReplay_;
+		std::shared_ptr<VirtualSynth> virtualSynth_;
+		std::shared_ptr<FingerprintIndex> knownPatches_;
+		std::shared_ptr<DownloadCheckpoints> checkpoints_; // Patches of interrupted downloads, to resume them
+
+		// Bank uploads by synth and bank, finished ones are replaced on the next upload of the same bank
+		CriticalSection uploadLock_;
+		std::map<std::string, std::shared_ptr<BankUpload>> uploads_;
 
 		std::string lastPath_; // Last import path
 		std::string lastExportDirectory_; 
 		std::string lastExportZipFilename_;
 		std::string lastExportSyxFilename_;
 		std::string lastExportMidFilename_;
+
+		// Last members, so they are shut down first while the sessions can still report back to us
+		std::unique_ptr<ThreadPool> uploader_;
+		std::unique_ptr<ThreadPool> parser_;
 	};
 
 }
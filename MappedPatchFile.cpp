@@ -0,0 +1,186 @@
+/*
+   Copyright (c) 2020 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#include "MappedPatchFile.h"
+
+#include "Sysex.h"
+
+namespace midikraft {
+
+	MappedPatchFile::MappedPatchFile(File const &file)
+	{
+		if (file.existsAsFile() && file.getSize() > 0) {
+			mapped_ = std::make_unique<MemoryMappedFile>(file, MemoryMappedFile::readOnly);
+			if (mapped_->getData() == nullptr) {
+				mapped_.reset();
+			}
+		}
+	}
+
+	bool MappedPatchFile::isOpen() const
+	{
+		return mapped_ != nullptr;
+	}
+
+	uint8 const *MappedPatchFile::data() const
+	{
+		return mapped_ ? static_cast<uint8 const *>(mapped_->getData()) : nullptr;
+	}
+
+	size_t MappedPatchFile::size() const
+	{
+		return mapped_ ? mapped_->getSize() : 0;
+	}
+
+	std::vector<MidiMessage> MappedPatchFile::sysexMessages() const
+	{
+		return splitSysex(data(), size());
+	}
+
+	bool MappedPatchFile::canStream(String const &filename)
+	{
+		return filename.endsWithIgnoreCase(".syx") || isMidiFile(filename);
+	}
+
+	bool MappedPatchFile::isMidiFile(String const &filename)
+	{
+		return filename.endsWithIgnoreCase(".mid");
+	}
+
+	bool MappedPatchFile::forEachSysex(bool isMidiFile, std::function<bool(MidiMessage const &)> handler) const
+	{
+		return forEachSysex(data(), size(), isMidiFile, handler);
+	}
+
+	bool MappedPatchFile::forEachSysex(uint8 const *data, size_t size, bool isMidiFile, std::function<bool(MidiMessage const &)> handler)
+	{
+		return isMidiFile ? forEachMidiFileSysex(data, size, handler) : forEachSyxSysex(data, size, handler);
+	}
+
+	bool MappedPatchFile::forEachSyxSysex(uint8 const *data, size_t size, std::function<bool(MidiMessage const &)> handler)
+	{
+		size_t start = 0;
+		bool inMessage = false;
+		for (size_t i = 0; i < size; i++) {
+			if (data[i] == 0xf0) {
+				// A new start before the end drops the unterminated message
+				start = i;
+				inMessage = true;
+			}
+			else if (data[i] == 0xf7 && inMessage) {
+				inMessage = false;
+				if (!handler(MidiMessage(data + start, (int)(i - start + 1)))) {
+					return false;
+				}
+			}
+		}
+		return true;
+	}
+
+	bool MappedPatchFile::forEachMidiFileSysex(uint8 const *data, size_t size, std::function<bool(MidiMessage const &)> handler)
+	{
+		// Just enough of a Standard MIDI File parser to find the sysex events, everything else is skipped
+		auto bytes = data;
+		size_t end = size;
+		auto readVariableLength = [bytes](size_t &pos, size_t limit, size_t &value) {
+			value = 0;
+			for (int i = 0; i < 4 && pos < limit; i++) {
+				uint8 byte = bytes[pos++];
+				value = (value << 7) | (byte & 0x7f);
+				if ((byte & 0x80) == 0) {
+					return true;
+				}
+			}
+			return false;
+		};
+
+		std::vector<uint8> sysex;
+		size_t chunk = 0;
+		while (chunk + 8 <= end) {
+			size_t chunkLength = ((size_t)bytes[chunk + 4] << 24) | ((size_t)bytes[chunk + 5] << 16) | ((size_t)bytes[chunk + 6] << 8) | bytes[chunk + 7];
+			size_t pos = chunk + 8;
+			size_t chunkEnd = std::min(end, pos + chunkLength);
+			if (std::memcmp(bytes + chunk, "MTrk", 4) == 0) {
+				uint8 runningStatus = 0;
+				bool inSysex = false;
+				while (pos < chunkEnd) {
+					size_t delta, length;
+					if (!readVariableLength(pos, chunkEnd, delta) || pos >= chunkEnd) {
+						break;
+					}
+					uint8 status = bytes[pos];
+					if (status >= 0x80) {
+						pos++;
+					}
+					else {
+						status = runningStatus;
+					}
+					if (status == 0xff) {
+						// Meta event
+						pos++;
+						if (!readVariableLength(pos, chunkEnd, length)) break;
+						pos += length;
+						runningStatus = 0;
+					}
+					else if (status == 0xf0 || status == 0xf7) {
+						// Sysex, or the continuation of a sysex split into several events
+						if (!readVariableLength(pos, chunkEnd, length) || pos + length > chunkEnd) break;
+						if (status == 0xf0) {
+							sysex.assign(1, 0xf0);
+							inSysex = true;
+						}
+						if (inSysex) {
+							sysex.insert(sysex.end(), bytes + pos, bytes + pos + length);
+							if (length > 0 && bytes[pos + length - 1] == 0xf7) {
+								inSysex = false;
+								if (!handler(MidiMessage(sysex.data(), (int)sysex.size()))) {
+									return false;
+								}
+							}
+						}
+						pos += length;
+						runningStatus = 0;
+					}
+					else if (status >= 0x80) {
+						runningStatus = status;
+						uint8 type = status & 0xf0;
+						pos += (type == 0xc0 || type == 0xd0) ? 1 : 2;
+					}
+					else {
+						// Data byte without status, the file is broken
+						break;
+					}
+				}
+			}
+			chunk = chunkEnd;
+		}
+		return true;
+	}
+
+	std::vector<MidiMessage> MappedPatchFile::splitSysex(uint8 const *data, size_t size)
+	{
+		std::vector<MidiMessage> result;
+		forEachSyxSysex(data, size, [&result](MidiMessage const &message) {
+			result.push_back(message);
+			return true;
+		});
+		return result;
+	}
+
+	std::vector<MidiMessage> MappedPatchFile::loadSysex(std::string const &fullpath)
+	{
+		File file(fullpath);
+		if (file.hasFileExtension(".syx")) {
+			MappedPatchFile mapped(file);
+			if (mapped.isOpen()) {
+				return mapped.sysexMessages();
+			}
+		}
+		// MIDI files need to be parsed
+		return Sysex::loadSysex(fullpath);
+	}
+
+}
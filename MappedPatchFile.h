@@ -0,0 +1,45 @@
+/*
+   Copyright (c) 2020 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#pragma once
+
+#include "JuceHeader.h"
+
+namespace midikraft {
+
+	// A patch file mapped into memory read-only, so even huge archive dumps are parsed without reading them into a buffer first
+	// and without the 2 GB limit of the stream read methods.
+	class MappedPatchFile {
+	public:
+		explicit MappedPatchFile(File const &file);
+
+		bool isOpen() const;
+		uint8 const *data() const;
+		size_t size() const;
+
+		// The sysex messages in the file, bytes outside of F0...F7 and unterminated messages are skipped
+		std::vector<MidiMessage> sysexMessages() const;
+		// Walks the sysex messages of a .syx or the sysex events of a .mid file one by one without collecting them.
+		// Stops early when the handler returns false, and returns false then
+		bool forEachSysex(bool isMidiFile, std::function<bool(MidiMessage const &)> handler) const;
+		// The same for bytes from elsewhere, e.g. a member of an archive
+		static bool forEachSysex(uint8 const *data, size_t size, bool isMidiFile, std::function<bool(MidiMessage const &)> handler);
+		// By the name only, so it works for archive members as well
+		static bool canStream(String const &filename);
+		static bool isMidiFile(String const &filename);
+
+		static std::vector<MidiMessage> splitSysex(uint8 const *data, size_t size);
+		// Maps .syx files, other files and files that can't be mapped are loaded the classic way
+		static std::vector<MidiMessage> loadSysex(std::string const &fullpath);
+
+	private:
+		static bool forEachSyxSysex(uint8 const *data, size_t size, std::function<bool(MidiMessage const &)> handler);
+		static bool forEachMidiFileSysex(uint8 const *data, size_t size, std::function<bool(MidiMessage const &)> handler);
+
+		std::unique_ptr<MemoryMappedFile> mapped_;
+	};
+
+}
@@ -0,0 +1,34 @@
+/*
+   Copyright (c) 2020 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#pragma once
+
+#include "JuceHeader.h"
+
+#include "MidiController.h"
+
+namespace midikraft {
+
+	// Plays the synth for downloads and uploads without any MIDI hardware, e.g. a replayed recording or an emulated device.
+	// Sessions send their messages here instead of to the synth, and get the answers from here instead of from the MidiController.
+	class MidiStandIn {
+	public:
+		virtual ~MidiStandIn() = default;
+
+		// The synth or sequencer played, by name. The Librarian sends the sessions for this device here instead of to its MIDI output
+		virtual std::string deviceName() const = 0;
+
+		// Answers are delivered to the input connected, on the stand-in's own thread just like the MIDI thread would do it
+		virtual void connect(std::function<void(MidiMessage const &)> input) = 0;
+		virtual void disconnect() = 0;
+
+		// Called instead of sending the messages to the synth, once per request
+		virtual void requestSent(std::vector<MidiMessage> const &messages) = 0;
+		// Called instead of letting the synth implementation send the first request of a handshake, which we can't see
+		virtual void handshakeStarted() = 0;
+	};
+
+}
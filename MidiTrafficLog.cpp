@@ -0,0 +1,98 @@
+/*
+   Copyright (c) 2020 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#include "MidiTrafficLog.h"
+
+#include "Logger.h"
+
+#include "fmt/format.h"
+
+namespace midikraft {
+
+	void MidiTrafficLog::recordIncoming(MidiMessage const &message)
+	{
+		record(message, true, false);
+	}
+
+	void MidiTrafficLog::recordOutgoing(std::vector<MidiMessage> const &messages)
+	{
+		bool first = true;
+		for (auto const &message : messages) {
+			record(message, false, first);
+			first = false;
+		}
+	}
+
+	void MidiTrafficLog::recordHandshakeStart()
+	{
+		record(MidiMessage(), false, true);
+	}
+
+	void MidiTrafficLog::clear()
+	{
+		ScopedLock lock(lock_);
+		entries_.clear();
+		startTime_ = 0.0;
+	}
+
+	std::vector<MidiTrafficLog::Entry> MidiTrafficLog::entries() const
+	{
+		ScopedLock lock(lock_);
+		return entries_;
+	}
+
+	void MidiTrafficLog::record(MidiMessage const &message, bool incoming, bool startsRequest)
+	{
+		double now = Time::getMillisecondCounterHiRes();
+		ScopedLock lock(lock_);
+		if (entries_.empty()) {
+			startTime_ = now;
+		}
+		entries_.push_back({ now - startTime_, incoming, message, startsRequest });
+	}
+
+	bool MidiTrafficLog::saveToFile(File const &file) const
+	{
+		String text;
+		for (auto const &entry : entries()) {
+			text += fmt::format("{} {:.3f} ", entry.incoming ? "in" : (entry.startsRequest ? "out" : "out+"), entry.timeMs);
+			text += String::toHexString(entry.message.getRawData(), entry.message.getRawDataSize()) + "\n";
+		}
+		if (!file.replaceWithText(text)) {
+			SimpleLogger::instance()->postMessage("Failed to write MIDI traffic to " + file.getFullPathName());
+			return false;
+		}
+		return true;
+	}
+
+	std::shared_ptr<MidiTrafficLog> MidiTrafficLog::loadFromFile(File const &file)
+	{
+		if (!file.existsAsFile()) {
+			SimpleLogger::instance()->postMessage("MIDI traffic file not found: " + file.getFullPathName());
+			return nullptr;
+		}
+		auto result = std::make_shared<MidiTrafficLog>();
+		StringArray lines;
+		lines.addLines(file.loadFileAsString());
+		for (auto const &line : lines) {
+			StringArray parts;
+			parts.addTokens(line, " ", "");
+			if (parts.size() < 3 || (parts[0] != "in" && parts[0] != "out" && parts[0] != "out+")) {
+				// Empty or broken line
+				continue;
+			}
+			MemoryBlock data;
+			data.loadFromHexString(line.fromFirstOccurrenceOf(parts[1], false, false));
+			if (data.getSize() == 0) {
+				continue;
+			}
+			MidiMessage message(data.getData(), (int)data.getSize());
+			result->entries_.push_back({ parts[1].getDoubleValue(), parts[0] == "in", message, parts[0] == "out" });
+		}
+		return result;
+	}
+
+}
@@ -0,0 +1,46 @@
+/*
+   Copyright (c) 2020 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#pragma once
+
+#include "JuceHeader.h"
+
+namespace midikraft {
+
+	// A recording of the MIDI traffic of a download, both directions, with the time each message was seen.
+	// Record a download from a real synth once, and replay it offline with the MidiTrafficReplay.
+	class MidiTrafficLog {
+	public:
+		struct Entry {
+			double timeMs; // Relative to the first recorded message
+			bool incoming;
+			MidiMessage message;
+			bool startsRequest = false; // Outgoing only, the first message of a request. The rest of the request follows directly
+		};
+
+		void recordIncoming(MidiMessage const &message);
+		// The messages are one request
+		void recordOutgoing(std::vector<MidiMessage> const &messages);
+		// The synth implementation sends the first request of a handshake itself, so we don't get to see it. An empty sysex message
+		// is recorded in its place, so a replay still knows when to answer
+		void recordHandshakeStart();
+		void clear();
+
+		std::vector<Entry> entries() const;
+
+		// One line per message, "in", "out" or "out+" for the following messages of a request, the time in milliseconds and the bytes in hex
+		bool saveToFile(File const &file) const;
+		static std::shared_ptr<MidiTrafficLog> loadFromFile(File const &file);
+
+	private:
+		void record(MidiMessage const &message, bool incoming, bool startsRequest);
+
+		CriticalSection lock_;
+		std::vector<Entry> entries_;
+		double startTime_ = 0.0;
+	};
+
+}
@@ -0,0 +1,150 @@
+/*
+   Copyright (c) 2020 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#include "MidiTrafficReplay.h"
+
+#include <algorithm>
+
+namespace midikraft {
+
+	MidiTrafficReplay::MidiTrafficReplay(std::shared_ptr<MidiTrafficLog> log, std::string const &deviceName, bool realTime) : Thread("MidiTrafficReplay"),
+		deviceName_(deviceName), realTime_(realTime), nextAnswer_(0)
+	{
+		// Split the recording into the answers to each request. Messages recorded before the first request are answer 0.
+		// With a request window, the answers to several requests might follow the last of them - they are released by that one as well
+		answers_.emplace_back();
+		double requestTime = 0.0;
+		if (log) {
+			for (auto const &entry : log->entries()) {
+				if (entry.incoming) {
+					answers_.back().push_back({ entry.timeMs - requestTime, true, entry.message });
+				}
+				else if (entry.startsRequest) {
+					answers_.emplace_back();
+					requestTime = entry.timeMs;
+				}
+			}
+		}
+		startThread();
+	}
+
+	MidiTrafficReplay::~MidiTrafficReplay()
+	{
+		signalThreadShouldExit();
+		wakeUp_.signal();
+		stopThread(1000);
+	}
+
+	std::string MidiTrafficReplay::deviceName() const
+	{
+		return deviceName_;
+	}
+
+	void MidiTrafficReplay::connect(std::function<void(MidiMessage const &)> input)
+	{
+		{
+			ScopedLock lock(deliveryLock_);
+			input_ = input;
+		}
+		ScopedLock lock(lock_);
+		wakeUp_.signal();
+		if (nextAnswer_ == 0) {
+			// Whatever the synth sent before our first request
+			releaseNextAnswer();
+		}
+	}
+
+	void MidiTrafficReplay::disconnect()
+	{
+		// Waits for a delivery in progress, the lock is reentrant so a handler may disconnect itself
+		ScopedLock lock(deliveryLock_);
+		input_ = nullptr;
+	}
+
+	void MidiTrafficReplay::requestSent(std::vector<MidiMessage> const &messages)
+	{
+		if (messages.empty()) {
+			return;
+		}
+		ScopedLock lock(lock_);
+		if (nextAnswer_ == 0) {
+			// Not connected yet, don't lose the initial answer
+			releaseNextAnswer();
+		}
+		releaseNextAnswer();
+	}
+
+	void MidiTrafficReplay::handshakeStarted()
+	{
+		// The recording has the start of the handshake as a request of its own
+		requestSent({ MidiMessage() });
+	}
+
+	bool MidiTrafficReplay::isExhausted() const
+	{
+		ScopedLock lock(lock_);
+		return nextAnswer_ >= answers_.size() && pending_.empty();
+	}
+
+	void MidiTrafficReplay::releaseNextAnswer()
+	{
+		// Called with lock_ held
+		if (nextAnswer_ >= answers_.size()) {
+			return;
+		}
+		double now = Time::getMillisecondCounterHiRes();
+		for (auto const &entry : answers_[nextAnswer_]) {
+			pending_.push_back({ realTime_ ? now + entry.timeMs : now, entry.message });
+		}
+		// The answers to a retried request might still be queued, keep them in order of arrival
+		std::stable_sort(pending_.begin(), pending_.end(), [](Pending const &a, Pending const &b) { return a.due < b.due; });
+		nextAnswer_++;
+		wakeUp_.signal();
+	}
+
+	void MidiTrafficReplay::run()
+	{
+		while (!threadShouldExit()) {
+			bool delivered = false;
+			int waitMs = -1;
+			{
+				// Hold back the answers while no session is listening, e.g. between two banks
+				ScopedLock delivery(deliveryLock_);
+				std::vector<MidiMessage> due;
+				{
+					ScopedLock lock(lock_);
+					double now = Time::getMillisecondCounterHiRes();
+					while (input_ && !pending_.empty() && pending_.front().due <= now) {
+						due.push_back(pending_.front().message);
+						pending_.pop_front();
+					}
+					if (!pending_.empty()) {
+						waitMs = input_ ? std::max(1, (int)(pending_.front().due - now)) : 10;
+					}
+				}
+				for (size_t i = 0; i < due.size(); i++) {
+					if (!input_) {
+						// The session stopped listening in the middle, keep the rest for the next one
+						ScopedLock lock(lock_);
+						std::vector<Pending> rest;
+						for (size_t j = i; j < due.size(); j++) {
+							rest.push_back({ 0.0, due[j] });
+						}
+						pending_.insert(pending_.begin(), rest.begin(), rest.end());
+						break;
+					}
+					auto input = input_; // The handler might disconnect itself
+					input(due[i]);
+					delivered = true;
+				}
+			}
+			if (!delivered) {
+				wakeUp_.wait(waitMs);
+			}
+		}
+	}
+
+}
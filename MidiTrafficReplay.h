@@ -0,0 +1,59 @@
+/*
+   Copyright (c) 2020 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#pragma once
+
+#include "JuceHeader.h"
+
+#include "MidiStandIn.h"
+#include "MidiTrafficLog.h"
+
+#include <deque>
+
+namespace midikraft {
+
+	// Plays back a recorded download in place of the synth. Every request the download session sends releases the answers
+	// that were recorded after the same request, either with the recorded delays or as fast as possible. The requests are matched
+	// by their order, so replay with the same request window the recording was made with.
+	class MidiTrafficReplay : public MidiStandIn, private Thread {
+	public:
+		// Plays the device with that name, see MidiStandIn::deviceName()
+		MidiTrafficReplay(std::shared_ptr<MidiTrafficLog> log, std::string const &deviceName, bool realTime);
+		virtual ~MidiTrafficReplay() override;
+
+		virtual std::string deviceName() const override;
+
+		// The download session receives the recorded answers here instead of from the MidiController
+		virtual void connect(std::function<void(MidiMessage const &)> input) override;
+		virtual void disconnect() override;
+
+		virtual void requestSent(std::vector<MidiMessage> const &messages) override;
+		virtual void handshakeStarted() override;
+
+		// True when all recorded answers have been delivered
+		bool isExhausted() const;
+
+	private:
+		struct Pending {
+			double due;
+			MidiMessage message;
+		};
+
+		void releaseNextAnswer();
+		virtual void run() override;
+
+		std::string deviceName_;
+		bool realTime_;
+		std::vector<std::vector<MidiTrafficLog::Entry>> answers_; // The incoming messages after each request until the next one, with the time relative to it
+		size_t nextAnswer_;
+		std::function<void(MidiMessage const &)> input_;
+		std::deque<Pending> pending_;
+		CriticalSection lock_;
+		CriticalSection deliveryLock_;
+		WaitableEvent wakeUp_;
+	};
+
+}
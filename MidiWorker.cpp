@@ -0,0 +1,146 @@
+/*
+   Copyright (c) 2020 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#include "MidiWorker.h"
+
+#include "Logger.h"
+
+#include "fmt/format.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace midikraft {
+
+	// A bank dump stream of a few thousand messages must fit in while the worker is busy with a slow handler
+	const int kInboxBytes = 1 << 20;
+
+	MidiWorker::Inbox::Inbox(MidiWorker *worker, THandler handler) : worker_(worker), handler_(handler), fifo_(kInboxBytes), ring_(kInboxBytes), closed_(false), dropped_(0)
+	{
+	}
+
+	void MidiWorker::Inbox::push(MidiMessage const &message)
+	{
+		if (closed_) {
+			return;
+		}
+		double timestamp = message.getTimeStamp();
+		uint32 size = (uint32) message.getRawDataSize();
+		int recordSize = (int) (sizeof(timestamp) + sizeof(size) + size);
+		SpinLock::ScopedLockType lock(producerLock_);
+		if (fifo_.getFreeSpace() < recordSize) {
+			// Can't log on the MIDI thread, the worker reports this
+			dropped_++;
+			return;
+		}
+		int start1, size1, start2, size2;
+		fifo_.prepareToWrite(recordSize, start1, size1, start2, size2);
+		// The record can wrap anywhere in the ring
+		int written = 0;
+		auto copyIn = [&](uint8 const *data, int bytes) {
+			for (int i = 0; i < bytes; i++, written++) {
+				ring_[written < size1 ? start1 + written : start2 + written - size1] = data[i];
+			}
+		};
+		copyIn(reinterpret_cast<uint8 const *>(&timestamp), (int) sizeof(timestamp));
+		copyIn(reinterpret_cast<uint8 const *>(&size), (int) sizeof(size));
+		copyIn(message.getRawData(), (int) size);
+		// Only complete records become visible to the worker
+		fifo_.finishedWrite(recordSize);
+		worker_->wakeUp_.signal();
+	}
+
+	bool MidiWorker::Inbox::deliver(std::vector<uint8> &scratch)
+	{
+		int ready = fifo_.getNumReady();
+		if (ready > 0) {
+			int start1, size1, start2, size2;
+			fifo_.prepareToRead(ready, start1, size1, start2, size2);
+			std::copy(ring_.data() + start1, ring_.data() + start1 + size1, scratch.data());
+			std::copy(ring_.data() + start2, ring_.data() + start2 + size2, scratch.data() + size1);
+			fifo_.finishedRead(size1 + size2);
+
+			int read = 0;
+			while (!closed_ && read + (int) (sizeof(double) + sizeof(uint32)) <= size1 + size2) {
+				double timestamp;
+				uint32 size;
+				std::memcpy(&timestamp, scratch.data() + read, sizeof(timestamp));
+				read += (int) sizeof(timestamp);
+				std::memcpy(&size, scratch.data() + read, sizeof(size));
+				read += (int) sizeof(size);
+				handler_(MidiMessage(scratch.data() + read, (int) size, timestamp));
+				read += (int) size;
+			}
+		}
+		int dropped = dropped_.exchange(0);
+		if (dropped > 0) {
+			SimpleLogger::instance()->postMessage(fmt::format("Warning: {} MIDI messages were lost because the download could not keep up", dropped));
+		}
+		return ready > 0;
+	}
+
+	MidiWorker::MidiWorker() : Thread("LibrarianMidiWorker"), generation_(0), scratch_(kInboxBytes)
+	{
+		startThread();
+	}
+
+	MidiWorker::~MidiWorker()
+	{
+		signalThreadShouldExit();
+		wakeUp_.signal();
+		stopThread(1000);
+	}
+
+	std::shared_ptr<MidiWorker::Inbox> MidiWorker::open(THandler handler)
+	{
+		std::shared_ptr<Inbox> inbox(new Inbox(this, handler));
+		ScopedLock lock(inboxLock_);
+		inboxes_.push_back(inbox);
+		generation_++;
+		wakeUp_.signal();
+		return inbox;
+	}
+
+	void MidiWorker::close(std::shared_ptr<Inbox> inbox)
+	{
+		if (!inbox) {
+			return;
+		}
+		inbox->closed_ = true;
+		{
+			ScopedLock lock(inboxLock_);
+			inboxes_.erase(std::remove(inboxes_.begin(), inboxes_.end(), inbox), inboxes_.end());
+			generation_++;
+		}
+		// Wait for its handler if it is running right now. The lock is reentrant, so a handler closing its own inbox doesn't block
+		ScopedLock delivery(inbox->deliveryLock_);
+	}
+
+	void MidiWorker::run()
+	{
+		std::vector<std::shared_ptr<Inbox>> inboxes;
+		int generation = -1;
+		while (!threadShouldExit()) {
+			if (generation != generation_) {
+				ScopedLock lock(inboxLock_);
+				inboxes = inboxes_;
+				generation = generation_;
+			}
+			bool delivered = false;
+			for (auto const &inbox : inboxes) {
+				ScopedLock delivery(inbox->deliveryLock_);
+				if (!inbox->closed_) {
+					delivered = inbox->deliver(scratch_) || delivered;
+				}
+			}
+			if (!delivered) {
+				// Every message pushed and every inbox opened wakes us up. A signal arriving while we deliver is kept for the next wait
+				wakeUp_.wait(-1);
+			}
+		}
+	}
+
+}
@@ -0,0 +1,61 @@
+/*
+   Copyright (c) 2020 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#pragma once
+
+#include "JuceHeader.h"
+
+#include <atomic>
+
+namespace midikraft {
+
+	// Runs the download state machines on its own thread instead of the MIDI input callback. The MIDI callback only copies
+	// the message bytes into the inbox of the session, so it does the same small amount of work for every message no matter what
+	// the session does with it. It doesn't allocate, it only signals the worker, which sleeps while all inboxes are empty.
+	class MidiWorker : private Thread {
+	public:
+		typedef std::function<void(MidiMessage const &)> THandler;
+
+		class Inbox {
+		public:
+			// Called on the MIDI input threads. Usually one input feeds an inbox, but several may, they take turns on a spin lock
+			void push(MidiMessage const &message);
+
+		private:
+			friend class MidiWorker;
+			Inbox(MidiWorker *worker, THandler handler);
+
+			// Worker thread, hands the messages queued to the handler. scratch is big enough for the whole ring
+			bool deliver(std::vector<uint8> &scratch);
+
+			MidiWorker *worker_;
+			THandler handler_;
+			SpinLock producerLock_;
+			AbstractFifo fifo_;
+			std::vector<uint8> ring_; // Records of the timestamp, 4 bytes length and the message bytes
+			CriticalSection deliveryLock_; // Held while the handler runs, so closing one inbox doesn't wait for the handlers of the others
+			std::atomic<bool> closed_;
+			std::atomic<int> dropped_;
+		};
+
+		MidiWorker();
+		virtual ~MidiWorker() override;
+
+		std::shared_ptr<Inbox> open(THandler handler);
+		// After close returns the handler is not running and won't be called again. Handlers may close their own inbox
+		void close(std::shared_ptr<Inbox> inbox);
+
+	private:
+		virtual void run() override;
+
+		CriticalSection inboxLock_;
+		std::vector<std::shared_ptr<Inbox>> inboxes_;
+		std::atomic<int> generation_; // Changes whenever an inbox is opened or closed
+		WaitableEvent wakeUp_;
+		std::vector<uint8> scratch_; // Linear copy of the ring of the inbox being delivered
+	};
+
+}
@@ -31,7 +31,8 @@ namespace midikraft {
 		*kFullPath = "fullpath",
 		*kTimeStamp = "timestamp",
 		*kBankNumber = "banknumber",
-		*kProgramNo = "program";
+		*kProgramNo = "program",
+		*kArchiveMember = "archivemember";
 
 	PatchHolder::PatchHolder(std::shared_ptr<Synth> activeSynth, std::shared_ptr<SourceInfo> sourceInfo, std::shared_ptr<DataFile> patch, 
 		MidiBankNumber bank, MidiProgramNumber place, std::shared_ptr<AutomaticCategory> detector /* = nullptr */)
@@ -435,13 +436,17 @@ namespace midikraft {
 		return bankNo_;
 	}
 
-	FromFileSource::FromFileSource(std::string const &filename, std::string const &fullpath, MidiProgramNumber program) : filename_(filename), fullpath_(fullpath), program_(program)
+	FromFileSource::FromFileSource(std::string const &filename, std::string const &fullpath, MidiProgramNumber program, std::string const &archiveMember /* = "" */) :
+		filename_(filename), fullpath_(fullpath), program_(program), archiveMember_(archiveMember)
 	{
 		rapidjson::Document doc;
 		doc.SetObject();
 		doc.AddMember(rapidjson::StringRef(kFileSource), true, doc.GetAllocator());
 		doc.AddMember(rapidjson::StringRef(kFileName), rapidjson::Value(filename.c_str(), (rapidjson::SizeType)  filename.size()), doc.GetAllocator());
 		doc.AddMember(rapidjson::StringRef(kFullPath), rapidjson::Value(fullpath.c_str(), (rapidjson::SizeType) fullpath.size()), doc.GetAllocator());
+		if (!archiveMember.empty()) {
+			doc.AddMember(rapidjson::StringRef(kArchiveMember), rapidjson::Value(archiveMember.c_str(), (rapidjson::SizeType) archiveMember.size()), doc.GetAllocator());
+		}
 		if (program.bank().isValid()) {
 			doc.AddMember(rapidjson::StringRef(kBankNumber), program.bank().toZeroBased(), doc.GetAllocator());
 			doc.AddMember(rapidjson::StringRef(kProgramNo), program.toZeroBasedWithBank(), doc.GetAllocator());
@@ -463,6 +468,9 @@ namespace midikraft {
 	std::string FromFileSource::toDisplayString(Synth *, bool shortVersion) const
 	{
 		ignoreUnused(shortVersion);
+		if (!archiveMember_.empty()) {
+			return fmt::format("Imported from file {} in {}", archiveMember_, filename_);
+		}
 		return fmt::format("Imported from file {}", filename_);
 	}
 
@@ -475,6 +483,10 @@ namespace midikraft {
 			if (obj.HasMember(kFileSource)) {
 				std::string filename = obj.FindMember(kFileName).operator*().value.GetString();
 				std::string fullpath = obj.FindMember(kFullPath).operator*().value.GetString();
+				std::string archiveMember;
+				if (obj.HasMember(kArchiveMember)) {
+					archiveMember = obj.FindMember(kArchiveMember).operator*().value.GetString();
+				}
 				MidiProgramNumber program = MidiProgramNumber::fromZeroBase(0);
 				if (obj.HasMember(kBankNumber)) {
 					jassertfalse;
@@ -484,7 +496,7 @@ namespace midikraft {
 				else {
 					program = MidiProgramNumber::fromZeroBase(obj.FindMember(kProgramNo).operator*().value.GetInt());
 				}
-				return std::make_shared<FromFileSource>(filename, fullpath, program);
+				return std::make_shared<FromFileSource>(filename, fullpath, program, archiveMember);
 			}
 		}
 		return nullptr;
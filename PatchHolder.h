@@ -69,7 +69,8 @@ namespace midikraft {
 
 	class FromFileSource : public SourceInfo {
 	public:
-		FromFileSource(std::string const &filename, std::string const &fullpath, MidiProgramNumber program);
+		// For a file inside of an archive, filename and fullpath are those of the archive
+		FromFileSource(std::string const &filename, std::string const &fullpath, MidiProgramNumber program, std::string const &archiveMember = "");
 		virtual std::string md5(Synth *synth) const override;
 		virtual std::string toDisplayString(Synth *synth, bool shortVersion) const override;
 		static std::shared_ptr<FromFileSource> fromString(std::string const &jsonString);
@@ -86,10 +87,15 @@ namespace midikraft {
 			return program_;
 		}
 
+		std::string archiveMember() const {
+			return archiveMember_;
+		}
+
 	private:
 		const std::string filename_;
 		const std::string fullpath_;
 		MidiProgramNumber program_;
+		const std::string archiveMember_;
 	};
 
 	class FromBulkImportSource : public SourceInfo {
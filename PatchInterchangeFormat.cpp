@@ -84,9 +84,11 @@ namespace midikraft {
 	*   1  - First version with header containing name of file format and version number, else it is identical to version 0 containing the patches in the field "Library" (to mark it is not a bank!)
 	*/
 
-	std::vector<midikraft::PatchHolder> PatchInterchangeFormat::load(std::map<std::string, std::shared_ptr<Synth>> activeSynths, std::string const &filename, std::shared_ptr<AutomaticCategory> detector)
+	std::vector<midikraft::PatchHolder> PatchInterchangeFormat::load(std::map<std::string, std::shared_ptr<Synth>> activeSynths, std::string const &filename, std::shared_ptr<AutomaticCategory> detector,
+		std::shared_ptr<FingerprintIndex> knownPatches /* = nullptr */)
 	{
 		std::vector<midikraft::PatchHolder> result;
+		int skipped = 0;
 
 		// Check if file exists
 		File pif(filename);
@@ -267,7 +269,11 @@ namespace midikraft {
 						auto messages = Sysex::memoryBlockToMessages(sysexData);
 						auto patches = activeSynth->loadSysex(messages);
 						//jassert(patches.size() == 1);
-						if (patches.size() == 1) {
+						if (patches.size() == 1 && knownPatches && knownPatches->contains(activeSynth->getName(), activeSynth->calculateFingerprint(patches[0]))) {
+							// Already in the database, don't bother creating the PatchHolder
+							skipped++;
+						}
+						else if (patches.size() == 1) {
 							PatchHolder holder(activeSynth, fileSource, patches[0], bank, place, detector);
 							holder.setFavorite(fav);
 							holder.setName(patchName);
@@ -293,6 +299,9 @@ namespace midikraft {
 				SimpleLogger::instance()->postMessage("No Library patches defined in PatchInterchangeFormat, no patches loaded");
 			}
 		}
+		if (skipped > 0) {
+			SimpleLogger::instance()->postMessage(fmt::format("Skipped {} patches from {} which are already in the database", skipped, pif.getFileName().toStdString()));
+		}
 		return result;
 	}
 
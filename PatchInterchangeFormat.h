@@ -10,12 +10,15 @@
 
 #include "PatchHolder.h"
 #include "AutomaticCategory.h"
+#include "FingerprintIndex.h"
 
 namespace midikraft {
 
 	class PatchInterchangeFormat {
 	public:
-		static std::vector<PatchHolder> load(std::map<std::string, std::shared_ptr<Synth>> activeSynths, std::string const &filename, std::shared_ptr<AutomaticCategory> detector);
+		// Patches in knownPatches are skipped, with all their metadata
+		static std::vector<PatchHolder> load(std::map<std::string, std::shared_ptr<Synth>> activeSynths, std::string const &filename, std::shared_ptr<AutomaticCategory> detector,
+			std::shared_ptr<FingerprintIndex> knownPatches = nullptr);
 		static void save(std::vector<PatchHolder> const &patches, std::string const &toFilename);
 	};
 
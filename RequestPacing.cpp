@@ -0,0 +1,160 @@
+/*
+   Copyright (c) 2020 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#include "RequestPacing.h"
+
+#include "Synth.h"
+#include "Settings.h"
+
+#include "fmt/format.h"
+
+#include <sstream>
+
+namespace midikraft {
+
+	// Without any measurement, we start with the values that have been hard coded for years
+	const double kDefaultRoundTripMs = 250.0;
+	const int kMinTimeoutMs = 100;
+	const int kMaxTimeoutMs = 5000;
+	const double kMaxGapMs = 1000.0;
+	// A MIDI DIN cable transports 3125 bytes per second, nothing is accepted faster than that
+	const double kMidiMsPerByte = 1.0 / 3.125;
+
+	RequestPacing::RequestPacing(std::shared_ptr<Synth> synth, Mode mode) : synthName_(synth ? synth->getName() : "unknown"), mode_(mode),
+		smoothedRoundTrip_(kDefaultRoundTripMs), roundTripVariation_(kDefaultRoundTripMs / 2.0), gap_(0.0), msPerByte_(kMidiMsPerByte), samples_(0), ignoreNextSample_(false), verified_(false)
+	{
+		// Load the profile learned in a previous session, if any
+		std::string stored = Settings::instance().get(settingsKey(), "");
+		if (!stored.empty()) {
+			std::istringstream in(stored);
+			double rtt, variation, gap;
+			if (in >> rtt >> variation >> gap) {
+				smoothedRoundTrip_ = rtt;
+				roundTripVariation_ = variation;
+				gap_ = gap;
+				samples_ = 1;
+				double perByte;
+				if (in >> perByte) {
+					msPerByte_ = std::max(kMidiMsPerByte, perByte);
+				}
+			}
+		}
+	}
+
+	void RequestPacing::requestSent()
+	{
+		ScopedLock lock(lock_);
+		requestsInFlight_.push_back(Time::getMillisecondCounterHiRes());
+	}
+
+	void RequestPacing::requestCompleted()
+	{
+		ScopedLock lock(lock_);
+		if (requestsInFlight_.empty()) {
+			// Unsolicited answer, nothing to measure
+			return;
+		}
+		double roundTrip = Time::getMillisecondCounterHiRes() - requestsInFlight_.front();
+		requestsInFlight_.pop_front();
+		if (ignoreNextSample_) {
+			// This was a retried request, we can't tell which of the requests was answered
+			ignoreNextSample_ = false;
+			return;
+		}
+		if (samples_ == 0) {
+			smoothedRoundTrip_ = roundTrip;
+			roundTripVariation_ = roundTrip / 2.0;
+		}
+		else {
+			// Same smoothing as TCP uses for its retransmission timer (RFC 6298)
+			roundTripVariation_ = 0.75 * roundTripVariation_ + 0.25 * std::abs(smoothedRoundTrip_ - roundTrip);
+			smoothedRoundTrip_ = 0.875 * smoothedRoundTrip_ + 0.125 * roundTrip;
+		}
+		samples_++;
+		// The synth keeps up, so slowly reduce the pause between requests
+		gap_ = gap_ * 0.9;
+		if (gap_ < 1.0) {
+			gap_ = 0.0;
+		}
+	}
+
+	void RequestPacing::requestTimedOut()
+	{
+		ScopedLock lock(lock_);
+		if (!requestsInFlight_.empty()) {
+			requestsInFlight_.pop_front();
+		}
+		ignoreNextSample_ = true;
+		// Back off - the synth is either slower than we thought, or we flooded it
+		smoothedRoundTrip_ = std::min((double)kMaxTimeoutMs, std::max(smoothedRoundTrip_ * 2.0, (double)kMinTimeoutMs));
+		gap_ = std::min(kMaxGapMs, std::max(10.0, gap_ * 2.0));
+	}
+
+	void RequestPacing::transferSent(size_t bytes, double milliseconds)
+	{
+		if (bytes == 0) {
+			return;
+		}
+		ScopedLock lock(lock_);
+		// An output that returns before the bytes are through tells us nothing beyond the cable speed
+		double measured = std::max(kMidiMsPerByte, milliseconds / bytes);
+		msPerByte_ = 0.875 * msPerByte_ + 0.125 * measured;
+		verified_ = true;
+	}
+
+	void RequestPacing::transferVerified(bool complete)
+	{
+		ScopedLock lock(lock_);
+		if (complete) {
+			gap_ = gap_ * 0.9;
+			if (gap_ < 1.0) {
+				gap_ = 0.0;
+			}
+		}
+		else {
+			gap_ = std::min(kMaxGapMs, std::max(10.0, gap_ * 2.0));
+		}
+		verified_ = true;
+	}
+
+	int RequestPacing::timeoutMs() const
+	{
+		ScopedLock lock(lock_);
+		int timeout = (int)(smoothedRoundTrip_ + 4.0 * roundTripVariation_);
+		return std::min(kMaxTimeoutMs, std::max(kMinTimeoutMs, timeout));
+	}
+
+	int RequestPacing::delayBeforeNextRequestMs() const
+	{
+		ScopedLock lock(lock_);
+		return (int)gap_;
+	}
+
+	int RequestPacing::retries() const
+	{
+		return 3;
+	}
+
+	int RequestPacing::transferTimeMs(size_t bytes) const
+	{
+		ScopedLock lock(lock_);
+		return (int)(bytes * msPerByte_);
+	}
+
+	void RequestPacing::persist() const
+	{
+		ScopedLock lock(lock_);
+		if (samples_ > 0 || verified_) {
+			Settings::instance().set(settingsKey(), fmt::format("{:.1f} {:.1f} {:.1f} {:.4f}", smoothedRoundTrip_, roundTripVariation_, gap_, msPerByte_));
+		}
+	}
+
+	std::string RequestPacing::settingsKey() const
+	{
+		return fmt::format("{}-pacing-{}", synthName_, static_cast<int>(mode_));
+	}
+
+}
@@ -0,0 +1,63 @@
+/*
+   Copyright (c) 2020 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#pragma once
+
+#include "JuceHeader.h"
+
+#include <deque>
+
+namespace midikraft {
+
+	class Synth;
+
+	// Measures the time from sending a request to the synth until the answer is complete, and derives timeouts and
+	// a pause between requests from it. The learned values are stored in the Settings per synth and download mode,
+	// so the next session starts with what we learned about the synth last time.
+	class RequestPacing {
+	public:
+		enum class Mode {
+			EDIT_BUFFER = 0,
+			PROGRAM_DUMP = 1,
+			BANK_DUMP = 2,
+			UPLOAD = 3 // No answers to measure, only the pause between two patches sent is used
+		};
+
+		RequestPacing(std::shared_ptr<Synth> synth, Mode mode);
+
+		void requestSent();
+		void requestCompleted();
+		void requestTimedOut();
+		// For uploads - how long it took until the output took the bytes. A synth or interface that throttles makes the send block
+		void transferSent(size_t bytes, double milliseconds);
+		// For uploads - did the synth store everything we sent? If not, we were too fast
+		void transferVerified(bool complete);
+
+		int timeoutMs() const;
+		int delayBeforeNextRequestMs() const;
+		int retries() const;
+		// For uploads - the time the synth needs to take that many bytes, at least the time they need through a MIDI cable
+		int transferTimeMs(size_t bytes) const;
+
+		void persist() const;
+
+	private:
+		std::string settingsKey() const;
+
+		std::string synthName_;
+		Mode mode_;
+		CriticalSection lock_;
+		std::deque<double> requestsInFlight_; // Send timestamps in ms
+		double smoothedRoundTrip_;
+		double roundTripVariation_;
+		double gap_;
+		double msPerByte_; // Upload speed the synth accepts
+		int samples_;
+		bool ignoreNextSample_;
+		bool verified_; // An upload has been measured or checked, worth persisting
+	};
+
+}
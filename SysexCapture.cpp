@@ -0,0 +1,185 @@
+/*
+   Copyright (c) 2020 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#include "SysexCapture.h"
+
+#include "Synth.h"
+#include "Logger.h"
+
+#include "fmt/format.h"
+
+namespace midikraft {
+
+	// A few minutes of sysex at MIDI line rate, so the capture thread can fall way behind during a long dump
+	const int kRingBufferSize = 1 << 20;
+	// A synth whose messages never form a patch shouldn't make us hold on to everything it sends
+	const size_t kMaxPendingMessages = 1024;
+	// Dumps we can't find the end of are loaded after this much silence
+	const double kSilenceMs = 500.0;
+
+	SysexCapture::SysexCapture(MidiDeviceInfo const &input, std::shared_ptr<SysexHeaderIndex> headerIndex, std::shared_ptr<AutomaticCategory> automaticCategories, TPatchesHandler onPatches) :
+		Thread("SysexCapture"), inputIdentifier_(input.identifier), headerIndex_(headerIndex), automaticCategories_(automaticCategories), onPatches_(onPatches), handle_(MidiController::makeOneHandle()),
+		fifo_(kRingBufferSize), ring_(kRingBufferSize), scratch_(kRingBufferSize), dropped_(0), lastArrival_(0.0), patchesCaptured_(0)
+	{
+		startThread();
+		MidiController::instance()->addMessageHandler(handle_, [this](MidiInput *source, MidiMessage const &message) {
+			// The handlers get every input, but the ring has only one writer - the thread of our input
+			if (source && source->getIdentifier() == inputIdentifier_) {
+				capture(message);
+			}
+		});
+	}
+
+	SysexCapture::~SysexCapture()
+	{
+		MidiController::instance()->removeMessageHandler(handle_);
+		signalThreadShouldExit();
+		dataArrived_.signal();
+		stopThread(1000);
+	}
+
+	int SysexCapture::patchesCaptured() const
+	{
+		return patchesCaptured_;
+	}
+
+	int SysexCapture::messagesDropped() const
+	{
+		return dropped_;
+	}
+
+	void SysexCapture::capture(MidiMessage const &message)
+	{
+		if (!message.isSysEx()) {
+			return;
+		}
+		uint32 size = (uint32) message.getRawDataSize();
+		int recordSize = (int) (sizeof(size) + size);
+		if (fifo_.getFreeSpace() < recordSize) {
+			// Can't log on the MIDI thread, the capture thread reports this
+			dropped_++;
+			return;
+		}
+		int start1, size1, start2, size2;
+		fifo_.prepareToWrite(recordSize, start1, size1, start2, size2);
+		// Copy length and data into the two blocks of the ring, the record can wrap anywhere
+		int written = 0;
+		auto copyIn = [&](uint8 const *data, int bytes) {
+			for (int i = 0; i < bytes; i++, written++) {
+				ring_[written < size1 ? start1 + written : start2 + written - size1] = data[i];
+			}
+		};
+		copyIn(reinterpret_cast<uint8 const *>(&size), (int) sizeof(size));
+		copyIn(message.getRawData(), (int) size);
+		// Only complete records become visible to the reader
+		fifo_.finishedWrite(recordSize);
+		dataArrived_.signal();
+	}
+
+	void SysexCapture::run()
+	{
+		while (!threadShouldExit()) {
+			int ready = fifo_.getNumReady();
+			if (ready == 0) {
+				if (!dataArrived_.wait(100)) {
+					loadSilentSynths();
+				}
+				continue;
+			}
+			lastArrival_ = Time::getMillisecondCounterHiRes();
+			int start1, size1, start2, size2;
+			fifo_.prepareToRead(ready, start1, size1, start2, size2);
+			std::copy(ring_.data() + start1, ring_.data() + start1 + size1, scratch_.data());
+			std::copy(ring_.data() + start2, ring_.data() + start2 + size2, scratch_.data() + size1);
+			fifo_.finishedRead(size1 + size2);
+
+			int read = 0;
+			while (read + (int) sizeof(uint32) <= size1 + size2) {
+				uint32 size;
+				std::memcpy(&size, scratch_.data() + read, sizeof(size));
+				read += (int) sizeof(size);
+				segment(MidiMessage(scratch_.data() + read, (int) size));
+				read += (int) size;
+			}
+
+			int dropped = dropped_.exchange(0);
+			if (dropped > 0) {
+				SimpleLogger::instance()->postMessage(fmt::format("Warning: {} sysex messages were lost because the capture could not keep up", dropped));
+			}
+		}
+	}
+
+	void SysexCapture::segment(MidiMessage const &message)
+	{
+		auto synths = headerIndex_->synthsForMessage(message);
+		if (synths.empty()) {
+			// Not for any synth we know
+			return;
+		}
+		auto synth = synths.front();
+		auto formats = formats_.find(synth);
+		if (formats == formats_.end()) {
+			formats = formats_.emplace(synth, DumpFormats(synth)).first;
+		}
+		auto &pending = pending_[synth];
+		pending.push_back(message);
+
+		if (!formats->second.knowsDumpEnd()) {
+			// Loaded when the synth falls silent, or when it sent too much to wait any longer
+			if (pending.size() >= kMaxPendingMessages) {
+				load(synth, pending);
+				pending.clear();
+			}
+			return;
+		}
+
+		// Only a complete dump is parsed, multi message formats only once their last message has arrived
+		if (formats->second.isCompleteDump(pending)) {
+			load(synth, pending);
+			pending.clear();
+		}
+		else if (pending.size() > 1 && formats->second.isCompleteDump({ message })) {
+			// Whatever came before never became a dump
+			pending.clear();
+			load(synth, { message });
+		}
+		else if (pending.size() > kMaxPendingMessages) {
+			pending.erase(pending.begin());
+		}
+	}
+
+	void SysexCapture::loadSilentSynths()
+	{
+		if (Time::getMillisecondCounterHiRes() - lastArrival_ < kSilenceMs) {
+			return;
+		}
+		for (auto &pending : pending_) {
+			if (!pending.second.empty() && !formats_.at(pending.first).knowsDumpEnd()) {
+				load(pending.first, pending.second);
+				pending.second.clear();
+			}
+		}
+	}
+
+	void SysexCapture::load(std::shared_ptr<Synth> synth, std::vector<MidiMessage> const &messages)
+	{
+		auto patches = synth->loadSysex(messages);
+		if (patches.empty()) {
+			return;
+		}
+
+		std::vector<PatchHolder> result;
+		Time now = Time::getCurrentTime();
+		for (auto const &patch : patches) {
+			result.push_back(PatchHolder(synth, std::make_shared<FromSynthSource>(now, MidiBankNumber::invalid()), patch,
+				MidiBankNumber::invalid(), MidiProgramNumber::fromZeroBase(patchesCaptured_++), automaticCategories_));
+		}
+		if (onPatches_) {
+			onPatches_(result);
+		}
+	}
+
+}
@@ -0,0 +1,65 @@
+/*
+   Copyright (c) 2020 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#pragma once
+
+#include "JuceHeader.h"
+
+#include "MidiController.h"
+#include "PatchHolder.h"
+#include "SysexHeaderIndex.h"
+#include "DumpFormats.h"
+
+#include <atomic>
+
+namespace midikraft {
+
+	class AutomaticCategory;
+
+	// Listens to one MIDI input while the user triggers dumps on the synth's front panel. The MIDI thread only copies the sysex bytes
+	// into a ring buffer allocated up front, the capture thread splits the stream by synth and hands out the patches as soon as a dump
+	// is complete. Synths whose dumps we can't find the end of are loaded once they have been silent for a moment.
+	// Capturing stops when the object is destroyed.
+	class SysexCapture : private Thread {
+	public:
+		// Called on the capture thread
+		typedef std::function<void(std::vector<PatchHolder>)> TPatchesHandler;
+
+		SysexCapture(MidiDeviceInfo const &input, std::shared_ptr<SysexHeaderIndex> headerIndex, std::shared_ptr<AutomaticCategory> automaticCategories, TPatchesHandler onPatches);
+		virtual ~SysexCapture() override;
+
+		int patchesCaptured() const;
+		int messagesDropped() const;
+
+	private:
+		virtual void run() override;
+
+		// MIDI thread
+		void capture(MidiMessage const &message);
+		// Capture thread
+		void segment(MidiMessage const &message);
+		void loadSilentSynths();
+		void load(std::shared_ptr<Synth> synth, std::vector<MidiMessage> const &messages);
+
+		String inputIdentifier_;
+		std::shared_ptr<SysexHeaderIndex> headerIndex_;
+		std::shared_ptr<AutomaticCategory> automaticCategories_;
+		TPatchesHandler onPatches_;
+		MidiController::HandlerHandle handle_;
+
+		AbstractFifo fifo_;
+		std::vector<uint8> ring_; // Records of 4 bytes length followed by the sysex bytes
+		std::vector<uint8> scratch_; // The capture thread's linear copy of the ring
+		WaitableEvent dataArrived_;
+		std::atomic<int> dropped_;
+
+		std::map<std::shared_ptr<Synth>, std::vector<MidiMessage>> pending_; // Messages of dumps not yet complete, by synth
+		std::map<std::shared_ptr<Synth>, DumpFormats> formats_;
+		double lastArrival_;
+		std::atomic<int> patchesCaptured_;
+	};
+
+}
@@ -0,0 +1,99 @@
+/*
+   Copyright (c) 2020 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#include "SysexHeaderIndex.h"
+
+#include <algorithm>
+
+namespace midikraft {
+
+	SysexHeaderIndex::SysexHeaderIndex(std::vector<SynthHolder> const &synths)
+	{
+		for (auto holder : synths) {
+			if (holder.synth()) {
+				synths_.push_back(holder.synth());
+			}
+		}
+	}
+
+	uint32 SysexHeaderIndex::headerKey(MidiMessage const &message)
+	{
+		// Sysex data starts after the F0. The manufacturer ID is one byte, or three bytes if the first is 0x00
+		auto data = message.getSysExData();
+		int size = message.getSysExDataSize();
+		int idLength = (size > 0 && data[0] == 0x00) ? 3 : 1;
+		uint32 key = (uint32) idLength; // Keep one and three byte IDs apart
+		for (int i = 0; i < idLength + 2 && i < size; i++) {
+			key = key * 131u + data[i];
+		}
+		return key;
+	}
+
+	std::vector<std::shared_ptr<Synth>> SysexHeaderIndex::scanAll(MidiMessage const &message) const
+	{
+		std::vector<std::shared_ptr<Synth>> result;
+		for (auto const &synth : synths_) {
+			if (synth->isOwnSysex(message)) {
+				result.push_back(synth);
+			}
+		}
+		return result;
+	}
+
+	std::vector<std::shared_ptr<Synth>> SysexHeaderIndex::synthsForMessage(MidiMessage const &message)
+	{
+		if (!message.isSysEx()) {
+			return {};
+		}
+		auto key = headerKey(message);
+		std::vector<std::shared_ptr<Synth>> candidates;
+		{
+			ScopedLock lock(lock_);
+			auto found = candidates_.find(key);
+			if (found != candidates_.end()) {
+				candidates = found->second;
+			}
+		}
+
+		std::vector<std::shared_ptr<Synth>> result;
+		for (auto const &synth : candidates) {
+			if (synth->isOwnSysex(message)) {
+				result.push_back(synth);
+			}
+		}
+		if (result.empty()) {
+			// A new key, or the synths look at more than the header, e.g. the channel. Ask everybody and remember who answered
+			result = scanAll(message);
+			if (result.empty()) {
+				// Misses are not remembered, the next message with this header might well be claimed
+				return result;
+			}
+		}
+
+		ScopedLock lock(lock_);
+		auto &known = candidates_[key];
+		for (auto const &synth : result) {
+			if (std::find(known.begin(), known.end(), synth) == known.end()) {
+				known.push_back(synth);
+			}
+		}
+		return result;
+	}
+
+	std::map<std::string, SysexHeaderIndex::Routed> SysexHeaderIndex::route(std::vector<MidiMessage> const &messages)
+	{
+		std::map<std::string, Routed> result;
+		for (auto const &message : messages) {
+			for (auto const &synth : synthsForMessage(message)) {
+				auto &routed = result[synth->getName()];
+				routed.synth = synth;
+				routed.messages.push_back(message);
+			}
+		}
+		return result;
+	}
+
+}
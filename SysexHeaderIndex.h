@@ -0,0 +1,44 @@
+/*
+   Copyright (c) 2020 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#pragma once
+
+#include "JuceHeader.h"
+
+#include "SynthHolder.h"
+
+#include <unordered_map>
+
+namespace midikraft {
+
+	// Finds the synth a sysex message belongs to without asking every synth. Messages are keyed by their manufacturer ID
+	// and the two bytes following it, which usually are the model or device ID. The first message with a new key is checked
+	// against all synths, after that only the synths which claimed that key are asked. Only keys claimed by a synth are remembered,
+	// a message nobody claims is checked against all synths every time.
+	class SysexHeaderIndex {
+	public:
+		SysexHeaderIndex(std::vector<SynthHolder> const &synths);
+
+		// The synths that claim this message via isOwnSysex, usually just one
+		std::vector<std::shared_ptr<Synth>> synthsForMessage(MidiMessage const &message);
+
+		struct Routed {
+			std::shared_ptr<Synth> synth;
+			std::vector<MidiMessage> messages;
+		};
+		// Splits the messages by the synth owning them, keeping their order. Messages nobody claims are dropped. By synth name, so the order is the same every time
+		std::map<std::string, Routed> route(std::vector<MidiMessage> const &messages);
+
+	private:
+		static uint32 headerKey(MidiMessage const &message);
+		std::vector<std::shared_ptr<Synth>> scanAll(MidiMessage const &message) const;
+
+		std::vector<std::shared_ptr<Synth>> synths_;
+		CriticalSection lock_; // Only for the map, the synths are asked without holding it
+		std::unordered_map<uint32, std::vector<std::shared_ptr<Synth>>> candidates_; // The synths that claimed a key
+	};
+
+}
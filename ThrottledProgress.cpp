@@ -0,0 +1,66 @@
+/*
+   Copyright (c) 2020 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#include "ThrottledProgress.h"
+
+#include "Settings.h"
+
+namespace midikraft {
+
+	ThrottledProgress::ThrottledProgress(ProgressHandler *target, int updatesPerSecond) : target_(target), intervalMs_(1000.0 / std::max(1, updatesPerSecond)),
+		latest_(0.0), lastForwarded_(0.0), pending_(false)
+	{
+	}
+
+	int ThrottledProgress::updatesPerSecondSetting()
+	{
+		int updatesPerSecond = String(Settings::instance().get("progressUpdatesPerSecond", "20")).getIntValue();
+		return std::max(1, updatesPerSecond);
+	}
+
+	bool ThrottledProgress::shouldAbort() const
+	{
+		return target_ && target_->shouldAbort();
+	}
+
+	void ThrottledProgress::setProgressPercentage(double zeroToOne)
+	{
+		latest_ = zeroToOne;
+		pending_ = true;
+		double now = Time::getMillisecondCounterHiRes();
+		double last = lastForwarded_;
+		// Only the thread winning the exchange passes the update on
+		if (now - last >= intervalMs_ && lastForwarded_.compare_exchange_strong(last, now)) {
+			pending_ = false;
+			if (target_) target_->setProgressPercentage(latest_);
+		}
+	}
+
+	void ThrottledProgress::onSuccess()
+	{
+		flush();
+		if (target_) target_->onSuccess();
+	}
+
+	void ThrottledProgress::onCancel()
+	{
+		flush();
+		if (target_) target_->onCancel();
+	}
+
+	void ThrottledProgress::setMessage(std::string const &message)
+	{
+		if (target_) target_->setMessage(message);
+	}
+
+	void ThrottledProgress::flush()
+	{
+		if (pending_.exchange(false) && target_) {
+			target_->setProgressPercentage(latest_);
+		}
+	}
+
+}
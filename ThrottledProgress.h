@@ -0,0 +1,43 @@
+/*
+   Copyright (c) 2020 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#pragma once
+
+#include "JuceHeader.h"
+
+#include "ProgressHandler.h"
+
+#include <atomic>
+
+namespace midikraft {
+
+	// Sits between a download and the progress handler of the UI. Progress updates are only passed on a few times per second,
+	// as a stream dump delivers hundreds of messages per second and each update might repaint. Success and cancel are passed on immediately,
+	// together with the latest progress. Can be called from any thread without locking.
+	class ThrottledProgress : public ProgressHandler {
+	public:
+		ThrottledProgress(ProgressHandler *target, int updatesPerSecond);
+
+		// Configurable in the Settings, defaults to 20
+		static int updatesPerSecondSetting();
+
+		virtual bool shouldAbort() const override;
+		virtual void setProgressPercentage(double zeroToOne) override;
+		virtual void onSuccess() override;
+		virtual void onCancel() override;
+		virtual void setMessage(std::string const &message) override;
+
+	private:
+		void flush();
+
+		ProgressHandler *target_;
+		double intervalMs_;
+		std::atomic<double> latest_;
+		std::atomic<double> lastForwarded_; // Time in ms
+		std::atomic<bool> pending_; // Progress not yet passed on
+	};
+
+}
@@ -0,0 +1,340 @@
+/*
+   Copyright (c) 2020 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#include "VirtualSynth.h"
+
+#include "Synth.h"
+#include "SynthBank.h"
+#include "ProgramDumpCapability.h"
+#include "EditBufferCapability.h"
+#include "BankDumpCapability.h"
+#include "StreamLoadCapability.h"
+#include "HasBanksCapability.h"
+
+#include <algorithm>
+
+namespace midikraft {
+
+	// A dump sent to us that never completes shouldn't pile up
+	const size_t kMaxReceivedMessages = 1024;
+	// Stream requests we know at least, for synths that don't tell how many messages their stream has
+	const int kMinStreamRequests = 128;
+
+	static std::vector<uint8> requestBytes(std::vector<MidiMessage> const &messages)
+	{
+		std::vector<uint8> bytes;
+		for (auto const &message : messages) {
+			bytes.insert(bytes.end(), message.getRawData(), message.getRawData() + message.getRawDataSize());
+		}
+		return bytes;
+	}
+
+	VirtualSynth::VirtualSynth(std::shared_ptr<Synth> synth, Options const &options) : Thread("VirtualSynth"), synth_(synth), options_(options), random_(options.seed),
+		currentBank_(0), currentProgram_(0), lineFreeAt_(0.0), answered_(0), lost_(0)
+	{
+		buildRequestTable();
+		startThread();
+	}
+
+	VirtualSynth::~VirtualSynth()
+	{
+		signalThreadShouldExit();
+		wakeUp_.signal();
+		stopThread(1000);
+	}
+
+	void VirtualSynth::storePatches(MidiBankNumber bankNo, TPatchVector const &patches)
+	{
+		ScopedLock lock(lock_);
+		int program = SynthBank::startIndexInBank(synth_, bankNo);
+		for (auto const &patch : patches) {
+			programs_[program++] = patch;
+		}
+	}
+
+	std::shared_ptr<DataFile> VirtualSynth::patchAt(int programNumberWithBank) const
+	{
+		ScopedLock lock(lock_);
+		auto found = programs_.find(programNumberWithBank);
+		return found != programs_.end() ? found->second : nullptr;
+	}
+
+	std::shared_ptr<Synth> VirtualSynth::synth() const
+	{
+		return synth_;
+	}
+
+	std::string VirtualSynth::deviceName() const
+	{
+		return synth_->getName();
+	}
+
+	void VirtualSynth::connect(std::function<void(MidiMessage const &)> input)
+	{
+		{
+			// A new download, a stream the last one didn't finish is not continued
+			ScopedLock lock(lock_);
+			streams_.clear();
+		}
+		ScopedLock lock(deliveryLock_);
+		input_ = input;
+		wakeUp_.signal();
+	}
+
+	void VirtualSynth::disconnect()
+	{
+		// Waits for a delivery in progress, the lock is reentrant so a handler may disconnect itself
+		ScopedLock lock(deliveryLock_);
+		input_ = nullptr;
+	}
+
+	void VirtualSynth::requestSent(std::vector<MidiMessage> const &messages)
+	{
+		if (messages.empty()) {
+			return;
+		}
+		// The request has to get through the cable first
+		double now = Time::getMillisecondCounterHiRes();
+		double requestEnd = now + requestBytes(messages).size() * 10000.0 / options_.baudRate;
+		ScopedLock lock(lock_);
+		sendAnswer(answerTo(messages), requestEnd);
+	}
+
+	void VirtualSynth::handshakeStarted()
+	{
+		// Handshake protocols are not emulated, the download will time out like with a synth that doesn't answer
+	}
+
+	int VirtualSynth::messagesAnswered() const
+	{
+		ScopedLock lock(lock_);
+		return answered_;
+	}
+
+	int VirtualSynth::messagesLost() const
+	{
+		ScopedLock lock(lock_);
+		return lost_;
+	}
+
+	void VirtualSynth::buildRequestTable()
+	{
+		// The table covers all banks. The answers are created when asked for, so they contain what has been stored or uploaded in the meantime
+		auto banks = Capability::hasCapability<HasBanksCapability>(synth_);
+		int numberOfBanks = banks ? banks->numberOfBanks() : 1;
+
+		auto editBuffer = Capability::hasCapability<EditBufferCapability>(synth_);
+		if (editBuffer) {
+			requests_.emplace(requestBytes(editBuffer->requestEditBufferDump()), [this, editBuffer]() {
+				auto patch = currentPatch();
+				return patch ? editBuffer->patchToSysex(patch) : std::vector<MidiMessage>();
+			});
+		}
+
+		auto programDump = Capability::hasCapability<ProgramDumpCabability>(synth_);
+		auto bankDump = Capability::hasCapability<BankDumpCapability>(synth_);
+		auto bankSend = Capability::hasCapability<BankSendCapability>(synth_);
+		for (int bank = 0; bank < numberOfBanks; bank++) {
+			auto bankNo = MidiBankNumber::fromZeroBase(bank, SynthBank::numberOfPatchesInBank(synth_, bank));
+			int firstProgram = SynthBank::startIndexInBank(synth_, bankNo);
+			int bankSize = SynthBank::numberOfPatchesInBank(synth_, bankNo);
+			if (programDump) {
+				for (int program = firstProgram; program < firstProgram + bankSize; program++) {
+					requests_.emplace(requestBytes(programDump->requestPatch(program)), [this, programDump, program]() {
+						auto patch = programs_.find(program);
+						return patch != programs_.end() ? programDump->patchToProgramDumpSysex(patch->second, MidiProgramNumber::fromZeroBase(program)) : std::vector<MidiMessage>();
+					});
+				}
+			}
+			if (bankDump && bankSend && programDump) {
+				requests_.emplace(requestBytes(bankDump->requestBankDump(bankNo)), [this, programDump, bankSend, firstProgram, bankSize]() {
+					std::vector<std::vector<MidiMessage>> programDumps;
+					for (int program = firstProgram; program < firstProgram + bankSize; program++) {
+						auto patch = programs_.find(program);
+						if (patch != programs_.end()) {
+							programDumps.push_back(programDump->patchToProgramDumpSysex(patch->second, MidiProgramNumber::fromZeroBase(program)));
+						}
+					}
+					return bankSend->createBankMessages(programDumps);
+				});
+			}
+		}
+
+		auto streamLoading = Capability::hasCapability<StreamLoadCapability>(synth_);
+		if (streamLoading) {
+			for (auto streamType : { StreamLoadCapability::StreamType::EDIT_BUFFER_DUMP, StreamLoadCapability::StreamType::BANK_DUMP }) {
+				// The first request of a bank stream names the bank, the following ones the element
+				int requests = std::max({ numberOfBanks, streamLoading->numberOfStreamMessagesExpected(streamType), kMinStreamRequests });
+				for (int element = 0; element < requests; element++) {
+					auto key = requestBytes(streamLoading->requestStreamElement(element, streamType));
+					if (!requests_.emplace(key, [this, streamType, element]() { return streamAnswer(streamType, element); }).second && element > 0) {
+						// The synth asks the same for every element, so the request doesn't tell the bank either
+						requests_[key] = [this, streamType]() { return streamAnswer(streamType, -1); };
+					}
+				}
+			}
+		}
+	}
+
+	int VirtualSynth::programIndex(int bank, int program) const
+	{
+		auto bankNo = MidiBankNumber::fromZeroBase(bank, SynthBank::numberOfPatchesInBank(synth_, bank));
+		return SynthBank::startIndexInBank(synth_, bankNo) + program;
+	}
+
+	std::shared_ptr<DataFile> VirtualSynth::currentPatch() const
+	{
+		// Called with lock_ held
+		auto current = programs_.find(currentProgram_);
+		return current != programs_.end() ? current->second : editBuffer_;
+	}
+
+	std::vector<MidiMessage> VirtualSynth::answerTo(std::vector<MidiMessage> const &request)
+	{
+		// Called with lock_ held
+		auto known = requests_.find(requestBytes(request));
+		if (known != requests_.end()) {
+			return known->second();
+		}
+		// Not one request as a whole, maybe a bank select and program change followed by a request, or a dump sent to us
+		std::vector<MidiMessage> answer;
+		for (auto const &message : request) {
+			if (message.isController() && message.getControllerNumber() == 0) {
+				currentBank_ = message.getControllerValue();
+				continue;
+			}
+			if (message.isProgramChange()) {
+				currentProgram_ = programIndex(currentBank_, message.getProgramChangeNumber());
+				continue;
+			}
+			auto single = requests_.find(requestBytes({ message }));
+			if (single != requests_.end()) {
+				auto part = single->second();
+				answer.insert(answer.end(), part.begin(), part.end());
+			}
+			else if (message.isSysEx()) {
+				receive(message);
+			}
+		}
+		return answer;
+	}
+
+	std::vector<MidiMessage> VirtualSynth::streamAnswer(StreamLoadCapability::StreamType streamType, int element)
+	{
+		// Called with lock_ held
+		auto streamLoading = Capability::hasCapability<StreamLoadCapability>(synth_);
+		auto &stream = streams_[(int)streamType];
+		if (stream.messages.empty()) {
+			// A new stream. The edit buffer stream is the edit buffer dump, the bank stream the program dumps of the bank asked for
+			if (streamType == StreamLoadCapability::StreamType::EDIT_BUFFER_DUMP) {
+				auto editBuffer = Capability::hasCapability<EditBufferCapability>(synth_);
+				auto patch = currentPatch();
+				if (editBuffer && patch) {
+					stream.messages = editBuffer->patchToSysex(patch);
+				}
+			}
+			else if (auto programDump = Capability::hasCapability<ProgramDumpCabability>(synth_)) {
+				int bank = element >= 0 ? element : currentBank_;
+				int firstProgram = programIndex(bank, 0);
+				int bankSize = SynthBank::numberOfPatchesInBank(synth_, bank);
+				for (int program = firstProgram; program < firstProgram + bankSize; program++) {
+					auto patch = programs_.find(program);
+					if (patch != programs_.end()) {
+						auto dump = programDump->patchToProgramDumpSysex(patch->second, MidiProgramNumber::fromZeroBase(program));
+						stream.messages.insert(stream.messages.end(), dump.begin(), dump.end());
+					}
+				}
+			}
+		}
+
+		// Send on until the synth implementation expects the next request, like the device would
+		std::vector<MidiMessage> answer;
+		while (stream.sent.size() < stream.messages.size()) {
+			answer.push_back(stream.messages[stream.sent.size()]);
+			stream.sent.push_back(answer.back());
+			if (streamLoading->isStreamComplete(stream.sent, streamType) || stream.sent.size() == stream.messages.size()) {
+				streams_.erase((int)streamType);
+				break;
+			}
+			if (streamLoading->shouldStreamAdvance(stream.sent, streamType)) {
+				break;
+			}
+		}
+		return answer;
+	}
+
+	void VirtualSynth::receive(MidiMessage const &message)
+	{
+		// Called with lock_ held
+		received_.push_back(message);
+		auto programDump = Capability::hasCapability<ProgramDumpCabability>(synth_);
+		auto editBuffer = Capability::hasCapability<EditBufferCapability>(synth_);
+		if (programDump && programDump->isSingleProgramDump(received_)) {
+			auto program = programDump->getProgramNumber(received_);
+			programs_[program.isBankKnown() ? program.toZeroBasedWithBank() : program.toZeroBased()] = programDump->patchFromProgramDumpSysex(received_);
+			received_.clear();
+		}
+		else if (editBuffer && editBuffer->isEditBufferDump(received_)) {
+			editBuffer_ = editBuffer->patchFromSysex(received_);
+			received_.clear();
+		}
+		else if (received_.size() > kMaxReceivedMessages) {
+			received_.erase(received_.begin());
+		}
+	}
+
+	void VirtualSynth::sendAnswer(std::vector<MidiMessage> const &answer, double requestEnd)
+	{
+		// Called with lock_ held. The answer starts after the latency, or when the line is free again, and every message takes its time on the wire
+		double sendTime = std::max(requestEnd + options_.latencyMs, lineFreeAt_);
+		for (auto const &message : answer) {
+			sendTime += message.getRawDataSize() * 10000.0 / options_.baudRate;
+			if (options_.lossRate > 0.0 && random_.nextFloat() < options_.lossRate) {
+				lost_++;
+				continue;
+			}
+			pending_.push_back({ sendTime, message });
+			answered_++;
+		}
+		if (!answer.empty()) {
+			lineFreeAt_ = sendTime;
+			wakeUp_.signal();
+		}
+	}
+
+	void VirtualSynth::run()
+	{
+		while (!threadShouldExit()) {
+			int waitMs = -1;
+			{
+				// Hold back the answers while no session is listening
+				ScopedLock delivery(deliveryLock_);
+				std::vector<MidiMessage> due;
+				{
+					ScopedLock lock(lock_);
+					double now = Time::getMillisecondCounterHiRes();
+					while (input_ && !pending_.empty() && pending_.front().due <= now) {
+						due.push_back(pending_.front().message);
+						pending_.pop_front();
+					}
+					if (!pending_.empty()) {
+						waitMs = input_ ? std::max(1, (int)(pending_.front().due - now)) : 10;
+					}
+				}
+				for (auto const &message : due) {
+					if (!input_) {
+						// The session stopped listening in the middle, the rest is lost like on a real cable
+						break;
+					}
+					auto input = input_; // The handler might disconnect itself
+					input(message);
+				}
+			}
+			wakeUp_.wait(waitMs);
+		}
+	}
+
+}
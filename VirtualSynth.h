@@ -0,0 +1,95 @@
+/*
+   Copyright (c) 2020 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#pragma once
+
+#include "JuceHeader.h"
+
+#include "MidiStandIn.h"
+#include "Patch.h"
+#include "StreamLoadCapability.h"
+
+#include <deque>
+
+namespace midikraft {
+
+	class Synth;
+
+	// Emulates the device behind a synth implementation, to benchmark and stress test downloads and uploads without hardware.
+	// It knows the requests the synth implementation creates and answers them with the patches in its memory, formatted by the same
+	// implementation, at the speed of the emulated MIDI line. Program and edit buffer dumps received are stored, so an upload can be read back.
+	// Program dump, edit buffer, bank dump and stream requests are answered for the bank asked for, or selected with bank select.
+	// Handshake protocols are specific to each synth and not emulated.
+	class VirtualSynth : public MidiStandIn, private Thread {
+	public:
+		struct Options {
+			int baudRate = 31250;
+			double latencyMs = 5.0; // From the end of the request until the synth starts answering
+			double lossRate = 0.0; // Share of the answer messages that get lost, 0 to 1
+			int seed = 1; // For the losses, so a run can be repeated
+		};
+
+		VirtualSynth(std::shared_ptr<Synth> synth, Options const &options);
+		virtual ~VirtualSynth() override;
+
+		// Puts the patches into the memory, starting at the first program of the bank
+		void storePatches(MidiBankNumber bankNo, TPatchVector const &patches);
+		std::shared_ptr<DataFile> patchAt(int programNumberWithBank) const;
+
+		std::shared_ptr<Synth> synth() const;
+
+		virtual std::string deviceName() const override;
+		virtual void connect(std::function<void(MidiMessage const &)> input) override;
+		virtual void disconnect() override;
+		virtual void requestSent(std::vector<MidiMessage> const &messages) override;
+		virtual void handshakeStarted() override;
+
+		int messagesAnswered() const;
+		int messagesLost() const;
+
+	private:
+		struct Pending {
+			double due;
+			MidiMessage message;
+		};
+
+		struct Stream {
+			std::vector<MidiMessage> messages; // The whole stream
+			std::vector<MidiMessage> sent; // Those sent so far
+		};
+
+		void buildRequestTable();
+		int programIndex(int bank, int program) const;
+		std::shared_ptr<DataFile> currentPatch() const;
+		std::vector<MidiMessage> answerTo(std::vector<MidiMessage> const &request);
+		std::vector<MidiMessage> streamAnswer(StreamLoadCapability::StreamType streamType, int element);
+		void receive(MidiMessage const &message);
+		void sendAnswer(std::vector<MidiMessage> const &answer, double requestEnd);
+		virtual void run() override;
+
+		std::shared_ptr<Synth> synth_;
+		Options options_;
+		Random random_;
+
+		mutable CriticalSection lock_;
+		std::map<int, std::shared_ptr<DataFile>> programs_; // By program number with bank
+		std::shared_ptr<DataFile> editBuffer_;
+		int currentBank_; // Zero based, from the last bank select
+		int currentProgram_; // With bank
+		std::map<std::vector<uint8>, std::function<std::vector<MidiMessage>()>> requests_; // The bytes of a request, and how to answer it
+		std::map<int, Stream> streams_; // Streams being sent, by stream type
+		std::vector<MidiMessage> received_; // Messages of a dump sent to us not yet complete
+		double lineFreeAt_; // When the emulated output line has sent everything queued
+		std::deque<Pending> pending_;
+		int answered_;
+		int lost_;
+
+		CriticalSection deliveryLock_;
+		std::function<void(MidiMessage const &)> input_;
+		WaitableEvent wakeUp_;
+	};
+
+}
@@ -0,0 +1,125 @@
+/*
+   Copyright (c) 2020 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#include "BenchSynth.h"
+
+#include "fmt/format.h"
+
+namespace midikraft {
+
+	namespace {
+		const std::vector<uint8> kHeader = { 0x7d, 0x42, 0x4b }; // After the F0
+		const int kPatchesPerBank = 128;
+		const int kBanks = 128;
+	}
+
+	BenchSynth::BenchSynth(int patchSize) : patchSize_(patchSize)
+	{
+	}
+
+	std::string BenchSynth::getName() const
+	{
+		return "Bench Synth";
+	}
+
+	std::shared_ptr<DataFile> BenchSynth::patchFromPatchData(const Synth::PatchData &data, MidiProgramNumber place) const
+	{
+		ignoreUnused(place);
+		return std::make_shared<Patch>(0, data);
+	}
+
+	bool BenchSynth::isOwnSysex(MidiMessage const &message) const
+	{
+		if (!message.isSysEx() || message.getSysExDataSize() < (int)kHeader.size() + 1) {
+			return false;
+		}
+		return std::equal(kHeader.begin(), kHeader.end(), message.getSysExData());
+	}
+
+	TPatchVector BenchSynth::loadSysex(std::vector<MidiMessage> const &sysexMessages)
+	{
+		TPatchVector result;
+		for (auto const &message : sysexMessages) {
+			if (isOwnSysex(message)) {
+				auto patch = patchFromProgramDumpSysex({ message });
+				if (patch) {
+					result.push_back(patch);
+				}
+			}
+		}
+		return result;
+	}
+
+	std::vector<MidiMessage> BenchSynth::dataFileToSysex(std::shared_ptr<DataFile> dataFile, std::shared_ptr<SendTarget> target)
+	{
+		ignoreUnused(target);
+		return patchToProgramDumpSysex(dataFile, MidiProgramNumber::fromZeroBase(0));
+	}
+
+	int BenchSynth::numberOfBanks() const
+	{
+		return kBanks;
+	}
+
+	int BenchSynth::numberOfPatches() const
+	{
+		return kPatchesPerBank;
+	}
+
+	std::string BenchSynth::friendlyBankName(MidiBankNumber bankNo) const
+	{
+		return fmt::format("Bank {}", bankNo.toOneBased());
+	}
+
+	std::vector<MidiMessage> BenchSynth::requestPatch(int patchNo) const
+	{
+		std::vector<uint8> request(kHeader);
+		request.push_back(0x01); // Request, too short to be taken for a dump
+		request.push_back((uint8)(patchNo & 0x7f));
+		return { MidiMessage::createSysExMessage(request.data(), (int)request.size()) };
+	}
+
+	bool BenchSynth::isSingleProgramDump(std::vector<MidiMessage> const &message) const
+	{
+		return message.size() == 1 && isOwnSysex(message[0]) && message[0].getSysExDataSize() == (int)kHeader.size() + 1 + patchSize_;
+	}
+
+	MidiProgramNumber BenchSynth::getProgramNumber(std::vector<MidiMessage> const &message) const
+	{
+		if (isSingleProgramDump(message)) {
+			return MidiProgramNumber::fromZeroBase(message[0].getSysExData()[kHeader.size()]);
+		}
+		return MidiProgramNumber::invalidProgram();
+	}
+
+	std::shared_ptr<DataFile> BenchSynth::patchFromProgramDumpSysex(std::vector<MidiMessage> const &message) const
+	{
+		if (!isSingleProgramDump(message)) {
+			return nullptr;
+		}
+		auto data = message[0].getSysExData() + kHeader.size() + 1;
+		return patchFromPatchData(Synth::PatchData(data, data + patchSize_), getProgramNumber(message));
+	}
+
+	std::vector<MidiMessage> BenchSynth::patchToProgramDumpSysex(std::shared_ptr<DataFile> patch, MidiProgramNumber programNumber) const
+	{
+		std::vector<uint8> dump(kHeader);
+		dump.push_back((uint8)(programNumber.toZeroBased() & 0x7f));
+		std::copy(patch->data().begin(), patch->data().end(), std::back_inserter(dump));
+		return { MidiMessage::createSysExMessage(dump.data(), (int)dump.size()) };
+	}
+
+	Synth::PatchData BenchSynth::randomPatchData(int seed) const
+	{
+		Random random(seed);
+		Synth::PatchData data(patchSize_);
+		for (auto &byte : data) {
+			byte = (uint8)random.nextInt(0x80);
+		}
+		return data;
+	}
+
+}
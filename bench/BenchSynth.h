@@ -0,0 +1,47 @@
+/*
+   Copyright (c) 2020 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#pragma once
+
+#include "JuceHeader.h"
+
+#include "Synth.h"
+#include "HasBanksCapability.h"
+#include "ProgramDumpCapability.h"
+
+namespace midikraft {
+
+	// A made up synth for the benchmark, so the corpus doesn't depend on any real synth implementation.
+	// Its program dump is F0 7D 42 4B <program> <patch data> F7, with 7D being the manufacturer ID for non-commercial use.
+	class BenchSynth : public Synth, public HasBanksCapability, public ProgramDumpCabability {
+	public:
+		explicit BenchSynth(int patchSize);
+
+		virtual std::string getName() const override;
+
+		virtual std::shared_ptr<DataFile> patchFromPatchData(const Synth::PatchData &data, MidiProgramNumber place) const override;
+		virtual bool isOwnSysex(MidiMessage const &message) const override;
+		virtual TPatchVector loadSysex(std::vector<MidiMessage> const &sysexMessages) override;
+		virtual std::vector<MidiMessage> dataFileToSysex(std::shared_ptr<DataFile> dataFile, std::shared_ptr<SendTarget> target) override;
+
+		virtual int numberOfBanks() const override;
+		virtual int numberOfPatches() const override;
+		virtual std::string friendlyBankName(MidiBankNumber bankNo) const override;
+
+		virtual std::vector<MidiMessage> requestPatch(int patchNo) const override;
+		virtual bool isSingleProgramDump(std::vector<MidiMessage> const &message) const override;
+		virtual MidiProgramNumber getProgramNumber(std::vector<MidiMessage> const &message) const override;
+		virtual std::shared_ptr<DataFile> patchFromProgramDumpSysex(std::vector<MidiMessage> const &message) const override;
+		virtual std::vector<MidiMessage> patchToProgramDumpSysex(std::shared_ptr<DataFile> patch, MidiProgramNumber programNumber) const override;
+
+		// Deterministic patch data, different for every seed
+		Synth::PatchData randomPatchData(int seed) const;
+
+	private:
+		int patchSize_;
+	};
+
+}
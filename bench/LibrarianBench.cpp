@@ -0,0 +1,274 @@
+/*
+   Copyright (c) 2020 Christof Ruch. All rights reserved.
+
+   Dual licensed: Distributed under Affero GPL license by default, an MIT license is available for purchase
+*/
+
+#include "JuceHeader.h"
+
+#include "BenchSynth.h"
+#include "Librarian.h"
+#include "PatchInterchangeFormat.h"
+#include "DirectoryScanCache.h"
+#include "FileHelpers.h"
+
+#include "fmt/format.h"
+
+#include <iostream>
+
+#if JUCE_WINDOWS
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+// Measures the throughput of the file import, the export and the patch interchange format on a synthetic corpus, and prints the results
+// as JSON, so runs can be compared between commits. Usage:
+//
+//   midikraft-librarian-bench [--files N] [--dump-patches N] [--patch-size BYTES] [--out results.json]
+//
+// Peak RSS is that of the process so far, so it can only grow from one benchmark to the next. Run a single configuration per process
+// when comparing memory use.
+
+using namespace midikraft;
+
+namespace {
+
+	struct BenchOptions {
+		int files = 1000; // Number of .syx files with one patch each, these are zipped for the archive as well
+		int dumpPatches = 10000; // Number of patches in the one big dump
+		int patchSize = 256; // Bytes of patch data per program dump
+		std::string out; // Print to stdout if empty
+	};
+
+	struct BenchResult {
+		std::string name;
+		size_t patches;
+		int64 bytes;
+		double seconds;
+	};
+
+	int64 peakRssKb()
+	{
+#if JUCE_WINDOWS
+		PROCESS_MEMORY_COUNTERS counters;
+		if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+			return (int64)(counters.PeakWorkingSetSize / 1024);
+		}
+		return 0;
+#else
+		struct rusage usage;
+		if (getrusage(RUSAGE_SELF, &usage) != 0) {
+			return 0;
+		}
+#if JUCE_MAC
+		return (int64)usage.ru_maxrss / 1024; // Bytes on macOS
+#else
+		return (int64)usage.ru_maxrss;
+#endif
+#endif
+	}
+
+	int64 sizeOnDisk(File const &fileOrDirectory)
+	{
+		if (!fileOrDirectory.isDirectory()) {
+			return fileOrDirectory.getSize();
+		}
+		int64 total = 0;
+		for (auto const &file : fileOrDirectory.findChildFiles(File::findFiles, true)) {
+			total += file.getSize();
+		}
+		return total;
+	}
+
+	nlohmann::json toJson(BenchResult const &result)
+	{
+		nlohmann::json json;
+		json["name"] = result.name;
+		json["patches"] = result.patches;
+		json["bytes"] = result.bytes;
+		json["seconds"] = result.seconds;
+		json["patches_per_second"] = result.seconds > 0.0 ? result.patches / result.seconds : 0.0;
+		json["bytes_per_second"] = result.seconds > 0.0 ? result.bytes / result.seconds : 0.0;
+		json["peak_rss_kb"] = peakRssKb();
+		return json;
+	}
+
+	template<typename T>
+	double timed(T work)
+	{
+		double start = Time::getMillisecondCounterHiRes();
+		work();
+		return (Time::getMillisecondCounterHiRes() - start) / 1000.0;
+	}
+
+	bool parseOptions(int argc, char *argv[], BenchOptions &options)
+	{
+		for (int i = 1; i < argc; i++) {
+			std::string arg(argv[i]);
+			bool hasValue = i + 1 < argc;
+			if (arg == "--files" && hasValue) {
+				options.files = std::atoi(argv[++i]);
+			}
+			else if (arg == "--dump-patches" && hasValue) {
+				options.dumpPatches = std::atoi(argv[++i]);
+			}
+			else if (arg == "--patch-size" && hasValue) {
+				options.patchSize = std::atoi(argv[++i]);
+			}
+			else if (arg == "--out" && hasValue) {
+				options.out = argv[++i];
+			}
+			else {
+				std::cerr << "Unknown option " << arg << std::endl;
+				return false;
+			}
+		}
+		return options.files > 0 && options.dumpPatches > 0 && options.patchSize > 0;
+	}
+
+	void appendDump(std::shared_ptr<BenchSynth> synth, int seed, std::vector<uint8> &bytes)
+	{
+		auto patch = synth->patchFromPatchData(synth->randomPatchData(seed), MidiProgramNumber::fromZeroBase(seed % 128));
+		for (auto const &message : synth->patchToProgramDumpSysex(patch, MidiProgramNumber::fromZeroBase(seed % 128))) {
+			std::copy(message.getRawData(), message.getRawData() + message.getRawDataSize(), std::back_inserter(bytes));
+		}
+	}
+
+	// Writes the many small files, the zip of them and the big dump into the directory
+	void createCorpus(std::shared_ptr<BenchSynth> synth, BenchOptions const &options, File const &directory)
+	{
+		File manyFiles = directory.getChildFile("many_files");
+		manyFiles.createDirectory();
+		ZipFile::Builder zip;
+		for (int i = 0; i < options.files; i++) {
+			std::vector<uint8> bytes;
+			appendDump(synth, i, bytes);
+			String name = fmt::format("patch_{:06d}.syx", i);
+			manyFiles.getChildFile(name).replaceWithData(bytes.data(), bytes.size());
+			zip.addEntry(new MemoryInputStream(bytes.data(), bytes.size(), true), 6, name, Time::getCurrentTime());
+		}
+		FileOutputStream zipStream(directory.getChildFile("many_files.zip"));
+		zip.writeToStream(zipStream, nullptr);
+		zipStream.flush();
+
+		std::vector<uint8> bigDump;
+		bigDump.reserve((size_t)options.dumpPatches * (options.patchSize + 6));
+		for (int i = 0; i < options.dumpPatches; i++) {
+			appendDump(synth, options.files + i, bigDump);
+		}
+		directory.getChildFile("big_dump.syx").replaceWithData(bigDump.data(), bigDump.size());
+	}
+
+	std::vector<PatchHolder> loadFile(Librarian &librarian, std::shared_ptr<Synth> synth, File const &file)
+	{
+		return librarian.loadSysexPatchesFromDisk(synth, file.getFullPathName().toStdString(), file.getFileName().toStdString(), nullptr);
+	}
+
+}
+
+int main(int argc, char *argv[])
+{
+	BenchOptions options;
+	if (!parseOptions(argc, argv, options)) {
+		std::cerr << "Usage: midikraft-librarian-bench [--files N] [--dump-patches N] [--patch-size BYTES] [--out results.json]" << std::endl;
+		return 1;
+	}
+
+	ScopedJuceInitialiser_GUI juce;
+	auto synth = std::make_shared<BenchSynth>(options.patchSize);
+	Librarian librarian({});
+	TemporaryDirectory tempDir("KnobKraftOrm", "librarian_bench");
+	File corpus = tempDir.asFile();
+	std::vector<BenchResult> results;
+
+	createCorpus(synth, options, corpus);
+
+	// Import
+	File manyFiles = corpus.getChildFile("many_files");
+	auto syxFiles = manyFiles.findChildFiles(File::findFiles, false, "*.syx");
+	size_t loaded = 0;
+	double seconds = timed([&]() {
+		for (auto const &file : syxFiles) {
+			loaded += loadFile(librarian, synth, file).size();
+		}
+	});
+	results.push_back({ "import_many_files", loaded, sizeOnDisk(manyFiles), seconds });
+
+	DirectoryRescan rescan;
+	DirectoryScanCache cache(corpus.getChildFile("scan_cache.txt"));
+	seconds = timed([&]() {
+		rescan = librarian.rescanDirectory(synth, manyFiles, cache, nullptr, nullptr);
+	});
+	results.push_back({ "import_many_files_rescan", rescan.patches.size(), sizeOnDisk(manyFiles), seconds });
+
+	File zipFile = corpus.getChildFile("many_files.zip");
+	std::vector<PatchHolder> patches;
+	seconds = timed([&]() { patches = loadFile(librarian, synth, zipFile); });
+	results.push_back({ "import_zip", patches.size(), zipFile.getSize(), seconds });
+
+	File bigDump = corpus.getChildFile("big_dump.syx");
+	seconds = timed([&]() { patches = loadFile(librarian, synth, bigDump); });
+	results.push_back({ "import_big_dump", patches.size(), bigDump.getSize(), seconds });
+
+	// Interchange format, with the patches of the big dump
+	File pif = corpus.getChildFile("big_dump.json");
+	seconds = timed([&]() { PatchInterchangeFormat::save(patches, pif.getFullPathName().toStdString()); });
+	results.push_back({ "pif_save", patches.size(), pif.getSize(), seconds });
+
+	std::map<std::string, std::shared_ptr<Synth>> synths;
+	synths[synth->getName()] = synth;
+	std::vector<PatchHolder> pifPatches;
+	seconds = timed([&]() { pifPatches = PatchInterchangeFormat::load(synths, pif.getFullPathName().toStdString(), nullptr); });
+	results.push_back({ "pif_load", pifPatches.size(), pif.getSize(), seconds });
+	pifPatches.clear();
+
+	// Export, in every format and file option. Many files would write one file per patch, so it only gets those of the small files
+	std::vector<PatchHolder> fewPatches(patches.begin(), patches.begin() + std::min(patches.size(), (size_t)options.files));
+	File exports = corpus.getChildFile("export");
+	exports.createDirectory();
+	std::vector<std::pair<int, std::string>> formats = { { Librarian::PROGRAM_DUMPS, "program_dumps" }, { Librarian::EDIT_BUFFER_DUMPS, "edit_buffer_dumps" } };
+	std::vector<std::tuple<int, std::string, std::string>> fileOptions = {
+		{ Librarian::MANY_FILES, "many_files", "" },
+		{ Librarian::ZIPPED_FILES, "zipped_files", ".zip" },
+		{ Librarian::ONE_FILE, "one_file", ".syx" },
+		{ Librarian::MID_FILE, "mid_file", ".mid" }
+	};
+	for (auto const &format : formats) {
+		for (auto const &fileOption : fileOptions) {
+			auto const &toExport = std::get<0>(fileOption) == Librarian::MANY_FILES ? fewPatches : patches;
+			std::string name = fmt::format("export_{}_{}", std::get<1>(fileOption), format.second);
+			File destination = exports.getChildFile(name + std::get<2>(fileOption));
+			if (std::get<0>(fileOption) == Librarian::MANY_FILES) {
+				destination.createDirectory();
+			}
+			bool ok = true;
+			seconds = timed([&]() { ok = Librarian::exportSysexPatches({ format.first, std::get<0>(fileOption) }, toExport, destination); });
+			if (!ok) {
+				std::cerr << "Export " << name << " failed" << std::endl;
+				return 2;
+			}
+			results.push_back({ name, toExport.size(), sizeOnDisk(destination), seconds });
+		}
+	}
+
+	nlohmann::json report;
+	report["corpus"] = { { "files", options.files }, { "dump_patches", options.dumpPatches }, { "patch_size", options.patchSize } };
+	report["os"] = SystemStats::getOperatingSystemName().toStdString();
+	report["cpus"] = SystemStats::getNumCpus();
+	report["results"] = nlohmann::json::array();
+	for (auto const &result : results) {
+		report["results"].push_back(toJson(result));
+	}
+	report["peak_rss_kb"] = peakRssKb();
+
+	if (options.out.empty()) {
+		std::cout << report.dump(2) << std::endl;
+	}
+	else if (!File(options.out).replaceWithText(report.dump(2))) {
+		std::cerr << "Could not write " << options.out << std::endl;
+		return 3;
+	}
+	return 0;
+}